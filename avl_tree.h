@@ -1,209 +1,727 @@
-// AVL, balanced binary search tree, using smart pointers.
+// AVL, balanced binary search tree, nodes held in a vector and linked by index.
+//
+// A node is its element and two 32-bit child links, with the balance factor
+// kept in the top bit of each link and no parent link, so an element costs
+// sizeof(T) + 8 bytes rounded up to alignof(T): 12 bytes for int, 16 for a
+// 64-bit key. The vector adds up to as much again while it grows; reserve()
+// and shrink_to_fit() remove that slack.
+//
+// Members it shares with tree<T>, such as lower_bound, assign_sorted,
+// shrink_to_fit and reset_stats, take the same standard library style names.
+#pragma once
 #include <ostream>   // ostreams
-#include <algorithm> // max
+#include <algorithm> // max, sort
+#include <cstddef>   // ptrdiff_t
+#include <iterator>  // move_iterator, forward_iterator_tag
+#include <cstdint>   // uint32_t
+#include <functional> // less
+#include <stdexcept> // length_error
+#include <type_traits> // is_same
+#include <vector>    // node storage
 
-template<typename T>
-class avl 
+#include "background_reclaimer.h"
+#include "frozen_tree.h"
+#include "tree_stats.h"
+
+template<typename T, typename Compare = std::less<>>
+class avl
 {
 private:
-    template<typename T>
-    class avlNode 
+    typedef std::uint32_t link;                  // Index of a node in nodes.
+
+    struct avlNode
     {
         T data;                                  // Node data element.
-        unsigned height = 0;                     // Depth of node.
-        std::shared_ptr<avlNode> left = nullptr; // Child nodes.
-        std::shared_ptr<avlNode> right = nullptr;
-
-        template<typename T> friend class avl;
+        link left = 0;                           // Child nodes; the top bit is set if
+        link right = 0;                          // that side is the taller one.
     };
 
-    std::shared_ptr<avlNode<T>> rootNode, emptyNode;
+    static constexpr link emptyNode = 0;         // nodes[emptyNode] is the empty sentinel.
+    static constexpr link taller = link(1) << 31;
+    static constexpr link indexMask = taller - 1;
+    static constexpr unsigned maxHeight = 48;    // Bound on AVL height for 2^31 nodes.
+
+    std::vector<avlNode> nodes;
+    link rootNode = emptyNode;
+    link freeNode = emptyNode;                   // Removed nodes, chained through left.
     std::size_t count = 0;                       // Count of nodes.
+    Compare comp;                                // Orders node data.
+    mutable tree_counters counters;              // Counts operations with AVL_TREE_STATS.
+
+    enum class order { in, pre, post };
 
 public:
-    avl() { rootNode = emptyNode = std::make_shared<avlNode<T>>(); }
+    // Forward iterator over the elements in the given order. It holds the path
+    // from the root to its node, so it allocates nothing and steps in amortized
+    // O(1). Any add or remove invalidates it.
+    template<order O>
+    class traversal_iterator
+    {
+        friend class avl;
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        traversal_iterator() { }
+
+        bool operator== (const traversal_iterator& it) const { return depth == it.depth && (depth == 0 || top() == it.top()); }
+        bool operator!= (const traversal_iterator& it) const { return !(*this == it); }
+
+        traversal_iterator& operator++ ()
+        {
+            if constexpr (O == order::in)
+            {
+                link node = t->rightOf(top());
+                if (node != emptyNode)
+                    descendLeft(node);
+                else
+                {
+                    // climb until arriving from a left child
+                    do
+                        node = path[--depth];
+                    while (depth > 0 && t->rightOf(top()) == node);
+                }
+            }
+            else if constexpr (O == order::pre)
+            {
+                link l = t->leftOf(top());
+                link r = t->rightOf(top());
+                if (l != emptyNode)
+                    path[depth++] = l;
+                else if (r != emptyNode)
+                    path[depth++] = r;
+                else
+                {
+                    // climb to the first ancestor with an unvisited right subtree
+                    while (--depth > 0)
+                    {
+                        link node = path[depth];
+                        r = t->rightOf(top());
+                        if (t->leftOf(top()) == node && r != emptyNode)
+                        {
+                            path[depth++] = r;
+                            break;
+                        }
+                    }
+                }
+            }
+            else
+            {
+                link node = path[--depth];
+                if (depth > 0 && t->leftOf(top()) == node && t->rightOf(top()) != emptyNode)
+                    descendFirst(t->rightOf(top()));
+            }
+            return *this;
+        }
+        traversal_iterator operator++ (int)
+        {
+            traversal_iterator old(*this);
+            ++(*this);
+            return old;
+        }
+
+        const T& operator* () const { return t->nodes[top()].data; }
+        const T* operator-> () const { return &t->nodes[top()].data; }
+
+    private:
+        explicit traversal_iterator(const avl* t) : t(t) { }
+
+        link top() const { return path[depth - 1]; }
+
+        void descendLeft(link node)
+        {
+            for (; node != emptyNode; node = t->leftOf(node))
+                path[depth++] = node;
+        }
+
+        // Push the path to the first post-order node of the subtree at node.
+        void descendFirst(link node)
+        {
+            while (node != emptyNode)
+            {
+                path[depth++] = node;
+                node = t->leftOf(node) != emptyNode ? t->leftOf(node) : t->rightOf(node);
+            }
+        }
+
+        const avl* t = nullptr;
+        link path[maxHeight];                    // Root first, the current node last.
+        unsigned depth = 0;                      // Zero at the end.
+    };
+
+    using const_iterator = traversal_iterator<order::in>;
+    using iterator = const_iterator;
+    using preorder_iterator = traversal_iterator<order::pre>;
+    using postorder_iterator = traversal_iterator<order::post>;
+
+    // A pair of iterators usable with range-based for and, in C++20, as a range.
+    template<typename It>
+    class view
+    {
+    public:
+        view(It first, It last) : first(first), last(last) { }
+        It begin() const { return first; }
+        It end() const { return last; }
+        bool empty() const { return first == last; }
+
+    private:
+        It first;
+        It last;
+    };
+
+    avl() : nodes(1) { }
+    explicit avl(const Compare& c) : nodes(1), comp(c) { }
+    template<typename InputIt>
+    avl(InputIt first, InputIt last, const Compare& c = Compare()) : nodes(1), comp(c) { assign(first, last); }
+
+    // Replace the contents with [first, last), sorting it first unless it is already in order.
+    template<typename InputIt>
+    void assign(InputIt first, InputIt last)
+    {
+        std::vector<T> v(first, last);
+
+        if (!std::is_sorted(v.begin(), v.end(), comp))
+            std::sort(v.begin(), v.end(), comp);
+        assign_sorted(std::make_move_iterator(v.begin()), std::make_move_iterator(v.end()));
+    }
+
+    // Replace the contents with the sorted range [first, last) in linear time.
+    // Nodes are stored in sorted order, so in-order walks are sequential.
+    template<typename InputIt>
+    void assign_sorted(InputIt first, InputIt last)
+    {
+        nodes.resize(1);
+        rootNode = freeNode = emptyNode;
+        count = 0;
+        for (; first != last; ++first)
+        {
+            // indices share their top bit with the balance flag, as in newNode
+            if (nodes.size() > indexMask)
+            {
+                nodes.resize(1);
+                throw std::length_error("avl: too many nodes");
+            }
+            nodes.emplace_back();
+            nodes.back().data = *first;
+        }
+        count = nodes.size() - 1;
+        unsigned height;
+        rootNode = buildNode(1, static_cast<link>(nodes.size()), height);
+    }
 
-    bool search(T data) { return search(rootNode, data); }
-    void add(T data) { rootNode = add(rootNode, data); }
+    // Searches compare once per level and test for equivalence at the end.
+    // The template overload takes any key type when Compare is transparent.
+    bool search(const T& data) const { return findNode(data) != emptyNode; }
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    bool search(const K& key) const { return findNode(key) != emptyNode; }
+    void add(const T& data) { insertNode(newNode(data)); }
+    void add(T&& data) { insertNode(newNode(std::move(data))); }
     // Reject duplicates.
     //void insert(T data) {
       //if (!search(rootNode, data))
         //rootNode = insert(rootNode, data);
     //}
-    void remove(T data) { rootNode = remove(rootNode, data); }
+    void remove(const T& data)
+    {
+        link path[maxHeight];
+        std::uint64_t wentLeft = 0;              // Bit i set if path[i] was left.
+        unsigned depth = 0;
+        unsigned found = maxHeight;              // Depth of the first node not less than data.
+
+        for (link node = rootNode; node != emptyNode; depth++)
+        {
+            path[depth] = node;
+            if (comp(nodes[node].data, data))
+                node = rightOf(node);
+            else
+            {
+                wentLeft |= std::uint64_t(1) << depth;
+                found = depth;
+                node = leftOf(node);
+            }
+        }
+        if (found == maxHeight || comp(data, nodes[path[found]].data))
+            return;
+        counters.erase();
+        depth = found;
+        wentLeft &= (std::uint64_t(1) << depth) - 1;
+
+        link node = path[depth];
+
+        link child;
+        if (leftOf(node) == emptyNode || rightOf(node) == emptyNode)
+        {
+            if (leftOf(node) == emptyNode)
+                child = rightOf(node);
+            else
+                child = leftOf(node);
+        }
+        else
+        {
+            // Take over the data of the successor and unlink that node instead.
+            link target = node;
+
+            path[depth++] = node;
+            for (node = rightOf(node); leftOf(node) != emptyNode; node = leftOf(node))
+            {
+                wentLeft |= std::uint64_t(1) << depth;
+                path[depth++] = node;
+            }
+            nodes[target].data = std::move(nodes[node].data);
+            child = rightOf(node);
+        }
+        deleteNode(node);
+        retrace(path, depth, wentLeft, child, true);
+    }
 
     std::size_t size() { return count; }
 
+    void clear()
+    {
+        nodes.resize(1);
+        rootNode = freeNode = emptyNode;
+        count = 0;
+    }
+    // Empty the tree at once and leave freeing the old node storage to r's thread.
+    void clear(background_reclaimer& r)
+    {
+        r.retire(std::move(nodes));
+        nodes.assign(1, avlNode());
+        rootNode = freeNode = emptyNode;
+        count = 0;
+    }
+
+    // In-order iteration; the elements cannot be modified in place.
+    const_iterator begin() const
+    {
+        const_iterator it(this);
+        it.descendLeft(rootNode);
+        return it;
+    }
+    const_iterator end() const { return const_iterator(this); }
+
+    // First element not less than key.
+    const_iterator lower_bound(const T& key) const { return lowerBoundIterator(key); }
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    const_iterator lower_bound(const K& key) const { return lowerBoundIterator(key); }
+
+    view<const_iterator> inOrderView() const { return { begin(), end() }; }
+    view<preorder_iterator> preOrderView() const
+    {
+        preorder_iterator it(this);
+        if (rootNode != emptyNode)
+            it.path[it.depth++] = rootNode;
+        return { it, preorder_iterator(this) };
+    }
+    view<postorder_iterator> postOrderView() const
+    {
+        postorder_iterator it(this);
+        it.descendFirst(rootNode);
+        return { it, postorder_iterator(this) };
+    }
+
+    // The elements in [lo, hi), in order.
+    view<const_iterator> range(const T& lo, const T& hi) const
+    {
+        return { lower_bound(lo), comp(lo, hi) ? lower_bound(hi) : lower_bound(lo) };
+    }
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    view<const_iterator> range(const K& lo, const K& hi) const
+    {
+        return { lower_bound(lo), comp(lo, hi) ? lower_bound(hi) : lower_bound(lo) };
+    }
+
+    // Call f(element) for each element in order. f may return bool, false to
+    // stop early; the result tells whether the walk reached the end.
+    template<typename F>
+    bool visitInOrder(F&& f) const { return visit(inOrderView(), f); }
+    template<typename F>
+    bool visitPreOrder(F&& f) const { return visit(preOrderView(), f); }
+    template<typename F>
+    bool visitPostOrder(F&& f) const { return visit(postOrderView(), f); }
+    template<typename F>
+    bool visitRange(const T& lo, const T& hi, F&& f) const { return visit(range(lo, hi), f); }
+
+    // Preallocate room for n elements, or drop the slack left by growth and removals.
+    void reserve(std::size_t n) { nodes.reserve(n + 1); }
+    void shrink_to_fit()
+    {
+        if (freeNode == emptyNode)
+            nodes.shrink_to_fit();
+    }
+
+    // Read-optimized copy of the current contents, see frozen_tree.h. The second
+    // form refreshes an existing snapshot in linear time, reusing its storage.
+    frozen_tree<T, Compare> freeze() const
+    {
+        frozen_tree<T, Compare> f(comp);
+        freeze(f);
+        return f;
+    }
+    void freeze(frozen_tree<T, Compare>& f) const
+    {
+        f.assignWith(count, [&](T* out) { std::copy(begin(), end(), out); });
+    }
+
+    // Operation counters (with AVL_TREE_STATS) and the current shape.
+    tree_stats stats() const
+    {
+        tree_stats s;
+        std::vector<std::pair<link, std::size_t>> stack;
+
+        counters.read(s);
+        s.size = count;
+        s.bytes = nodes.capacity() * sizeof(avlNode);
+        if (rootNode != emptyNode)
+            stack.emplace_back(rootNode, 0);
+        while (!stack.empty())
+        {
+            link node = stack.back().first;
+            std::size_t d = stack.back().second;
+
+            stack.pop_back();
+            if (s.levels.size() <= d)
+                s.levels.resize(d + 1);
+            ++s.levels[d];
+            if (leftOf(node) != emptyNode)
+                stack.emplace_back(leftOf(node), d + 1);
+            if (rightOf(node) != emptyNode)
+                stack.emplace_back(rightOf(node), d + 1);
+        }
+        s.height = s.levels.size();
+
+        return s;
+    }
+    void reset_stats() { counters.reset(); }
+
     // Min value from AVL is leftmost node, max is rightmost node in the tree.
     T min() {
-        std::shared_ptr<avlNode<T>> node = rootNode;
-        
-        while (node->left != emptyNode)
-            node = node->left;
-        
-        return node->data;
+        link node = rootNode;
+
+        while (leftOf(node) != emptyNode)
+            node = leftOf(node);
+
+        return nodes[node].data;
     }
 
     T max() {
-        std::shared_ptr<avlNode<T>> node = rootNode;
-        
-        while (node->right != emptyNode)
-            node = node->right;
-        
-        return node->data;
+        link node = rootNode;
+
+        while (rightOf(node) != emptyNode)
+            node = rightOf(node);
+
+        return nodes[node].data;
     }
 
-    void inOrder(std::ostream& os) { inOrder(os, rootNode); }
-    void preOrder(std::ostream& os) { preOrder(os, rootNode); }
-    void postOrder(std::ostream& os) { postOrder(os, rootNode); }
+    void inOrder(std::ostream& os) { visitInOrder([&](const T& t) { os << t << " "; }); }
+    void preOrder(std::ostream& os) { visitPreOrder([&](const T& t) { os << t << " "; }); }
+    void postOrder(std::ostream& os) { visitPostOrder([&](const T& t) { os << t << " "; }); }
 
 private:
-    // Balance tree.
-    std::shared_ptr<avlNode<T>> add(std::shared_ptr<avlNode<T>> node, T d) 
-    {
-        if (node == emptyNode) 
-        {
-            node = std::make_shared<avlNode<T>>();
-            node->data = d;
-            node->left = node->right = emptyNode;
-            node->height = 1;
-            count++;
-        
-            return node;
-        }
-        
-        if (d <= node->data)
-            node->left = add(node->left, d);
-        else
-            node->right = add(node->right, d);
-        
-        return balance(node);
+    link leftOf(link node) const { return nodes[node].left & indexMask; }
+    link rightOf(link node) const { return nodes[node].right & indexMask; }
+    void setLeft(link node, link child) { nodes[node].left = (nodes[node].left & taller) | child; }
+    void setRight(link node, link child) { nodes[node].right = (nodes[node].right & taller) | child; }
+
+    // Height of the right subtree less that of the left, -1 to 1.
+    int balanceOf(link node) const { return int(nodes[node].right >> 31) - int(nodes[node].left >> 31); }
+    void setBalance(link node, int b)
+    {
+        nodes[node].left = (nodes[node].left & indexMask) | (b < 0 ? taller : 0);
+        nodes[node].right = (nodes[node].right & indexMask) | (b > 0 ? taller : 0);
     }
 
-    bool search(std::shared_ptr<avlNode<T>> node, T d) 
+    // First node not less than key, or emptyNode.
+    template<typename K>
+    link lowerBoundNode(const K& key) const
     {
-        if (node == emptyNode)
-            return false;
-        
-        if (node->data == d)
-            return true;
-        
-        if (d < node->data)
-            return search(node->left, d);
-        else
-            return search(node->right, d);
+        link res = emptyNode;
+
+        for (link node = rootNode; node != emptyNode; )
+        {
+            counters.compare();
+            if (comp(nodes[node].data, key))
+                node = rightOf(node);
+            else
+            {
+                res = node;
+                node = leftOf(node);
+            }
+        }
+
+        return res;
     }
 
-    std::shared_ptr<avlNode<T>> remove(std::shared_ptr<avlNode<T>> node, T d) 
+    template<typename K>
+    const_iterator lowerBoundIterator(const K& key) const
     {
-        std::shared_ptr<avlNode<T>> t;
+        const_iterator it(this);
+        unsigned found = 0;                      // Path length up to the answer.
 
-        if (node == emptyNode)
-            return node;
-        if (node->data == d) 
+        for (link node = rootNode; node != emptyNode; )
         {
-            if (node->left == emptyNode || node->right == emptyNode) 
+            it.path[it.depth++] = node;
+            if (comp(nodes[node].data, key))
+                node = rightOf(node);
+            else
             {
-                if (node->left == emptyNode)
-                    t = node->right;
-                else
-                    t = node->left;
-                node.reset();
-                count--;
-        
-                return t;
+                found = it.depth;
+                node = leftOf(node);
             }
-            else 
+        }
+        it.depth = found;
+
+        return it;
+    }
+
+    template<typename V, typename F>
+    static bool visit(const V& v, F& f)
+    {
+        for (const T& t : v)
+        {
+            if constexpr (std::is_same<decltype(f(t)), bool>::value)
             {
-                for (t = node->right; t->left != emptyNode; t = t->left);
-                node->data = t->data;
-                node->right = remove(node->right, t->data);
-                return balance(node);
+                if (!f(t))
+                    return false;
             }
+            else
+                f(t);
         }
-        
-        if (d < node->data)
-            node->left = remove(node->left, d);
-        else
-            node->right = remove(node->right, d);
-        
-        return balance(node);
+        return true;
     }
 
-    // Updates the depth of the node in the tree.
-    void setNodeHeight(std::shared_ptr<avlNode<T>> node) 
+    template<typename K>
+    link findNode(const K& key) const
     {
-        node->height = 1 + std::max(node->left->height, node->right->height);
+        counters.find();
+        link node = lowerBoundNode(key);
+
+        if (node == emptyNode)
+            return emptyNode;
+        counters.compare();
+        return !comp(key, nodes[node].data) ? node : emptyNode;
     }
 
-    std::shared_ptr<avlNode<T>> rotateLeft(std::shared_ptr<avlNode<T>> node) 
+    // Take a node from the free list, or append one.
+    template<typename U>
+    link newNode(U&& d)
     {
-        std::shared_ptr<avlNode<T>> leftNode = node->left;
-    
-        node->left = leftNode->right;
-        leftNode->right = node;
-        setNodeHeight(node);
-        setNodeHeight(leftNode);
-        
-        return leftNode;
+        link node = freeNode;
+
+        if (node != emptyNode)
+        {
+            freeNode = nodes[node].left;
+            nodes[node].data = std::forward<U>(d);
+        }
+        else
+        {
+            if (nodes.size() > indexMask)
+                throw std::length_error("avl: too many nodes");
+            node = static_cast<link>(nodes.size());
+            if (nodes.size() < nodes.capacity())
+            {
+                nodes.emplace_back();
+                nodes[node].data = std::forward<U>(d);
+            }
+            else
+            {
+                // d may be an element of nodes, so take it before they move
+                T t(std::forward<U>(d));
+                nodes.emplace_back();
+                nodes[node].data = std::move(t);
+            }
+        }
+        nodes[node].left = nodes[node].right = emptyNode;
+        count++;
+
+        return node;
     }
 
-    std::shared_ptr<avlNode<T>> rotateRight(std::shared_ptr<avlNode<T>> node) 
+    void deleteNode(link node)
     {
-        std::shared_ptr<avlNode<T>> rightNode = node->right;
-        
-        node->right = rightNode->left;
-        rightNode->left = node;
-        setNodeHeight(node);
-        setNodeHeight(rightNode);
-        
-        return rightNode;
+        nodes[node].data = T();
+        nodes[node].left = freeNode;
+        freeNode = node;
+        count--;
+    }
+
+    // Descend once to the leaf position of the new node, recording the path,
+    // then link it and rebalance upwards.
+    void insertNode(link leaf)
+    {
+        const T& d = nodes[leaf].data;
+        link path[maxHeight];
+        std::uint64_t wentLeft = 0;              // Bit i set if path[i] was left.
+        unsigned depth = 0;
+
+        for (link node = rootNode; node != emptyNode; depth++)
+        {
+            path[depth] = node;
+            if (!comp(nodes[node].data, d))
+            {
+                wentLeft |= std::uint64_t(1) << depth;
+                node = leftOf(node);
+            }
+            else
+                node = rightOf(node);
+        }
+
+        counters.insert();
+        retrace(path, depth, wentLeft, leaf, false);
     }
 
-    // Balance nodes so no 2 subtrees of a node have max depth with a difference greater than 1.
-    std::shared_ptr<avlNode<T>> balance(std::shared_ptr<avlNode<T>> node) 
+    // Relink child under path[depth - 1] and rebalance up the path. child's
+    // subtree has grown by one level on insert, or shrunk by one on erase;
+    // stop once a subtree keeps its height.
+    void retrace(const link* path, unsigned depth, std::uint64_t wentLeft, link child, bool erasing)
     {
-        setNodeHeight(node);
-        if (node->left->height > node->right->height + 1) 
+        bool changed = true;
+
+        while (depth > 0)
         {
-            if (node->left->right->height > node->left->left->height)
-                node->left = rotateRight(node->left);
-            node = rotateLeft(node);
+            counters.retrace(erasing);
+            link node = path[--depth];
+            bool left = (wentLeft & (std::uint64_t(1) << depth)) != 0;
+
+            if (left)
+                setLeft(node, child);
+            else
+                setRight(node, child);
+            if (!changed)
+                return;
+
+            // The side that changed gains (insert) or loses (erase) a level.
+            int b = balanceOf(node) + (left == erasing ? 1 : -1);
+            if (b == 0)
+            {
+                setBalance(node, 0);
+                if (!erasing)
+                    return;
+                child = node;
+            }
+            else if (b == 1 || b == -1)
+            {
+                setBalance(node, b);
+                if (erasing)
+                    return;
+                child = node;
+            }
+            else
+            {
+                // A rotation restores the height an insert added, but an erase
+                // only when the sibling was balanced.
+                child = balance(node, b, erasing, changed);
+                changed = erasing && changed;
+            }
         }
-        else if (node->right->height > node->left->height + 1) 
+        rootNode = child;
+    }
+
+    // Link nodes [lo, hi) into a perfectly balanced subtree and return its root.
+    link buildNode(link lo, link hi, unsigned& height)
+    {
+        if (lo == hi)
         {
-            if (node->right->left->height > node->right->right->height)
-                node->right = rotateLeft(node->right);
-            node = rotateRight(node);
+            height = 0;
+            return emptyNode;
         }
-        
-        return node;
+
+        link mid = lo + (hi - lo) / 2;
+        unsigned hl, hr;
+
+        nodes[mid].left = buildNode(lo, mid, hl);
+        nodes[mid].right = buildNode(mid + 1, hi, hr);
+        setBalance(mid, int(hr) - int(hl));
+        height = 1 + std::max(hl, hr);
+
+        return mid;
     }
 
-    void inOrder(std::ostream& os, std::shared_ptr<avlNode<T>> node) 
+    // Lift the left child of node over it; the caller sets the balance factors.
+    link rotateLeft(link node)
     {
-        if (node == emptyNode)
-            return;
-        inOrder(os, node->left);
-        os << node->data << " ";
-        inOrder(os, node->right);
+        link leftNode = leftOf(node);
+
+        setLeft(node, rightOf(leftNode));
+        setRight(leftNode, node);
+
+        return leftNode;
     }
-    
-    void preOrder(std::ostream& os, std::shared_ptr<avlNode<T>> node) 
+
+    link rotateRight(link node)
     {
-        if (node == emptyNode)
-            return;
-        os << node->data << " ";
-        preOrder(os, node->left);
-        preOrder(os, node->right);
+        link rightNode = rightOf(node);
+
+        setRight(node, leftOf(rightNode));
+        setLeft(rightNode, node);
+
+        return rightNode;
     }
-    
-    void postOrder(std::ostream& os, std::shared_ptr<avlNode<T>> node) 
+
+    // Rotate node, whose balance has reached b = -2 or 2, and return the new
+    // subtree root. shrunk tells whether the subtree is now a level lower than
+    // before the rotation.
+    link balance(link node, int b, bool erasing, bool& shrunk)
     {
-        if (node == emptyNode)
-            return;
-        postOrder(os, node->left);
-        postOrder(os, node->right);
-        os << node->data << " ";
+        link top;
+
+        if (b < 0)
+        {
+            link l = leftOf(node);
+            int bl = balanceOf(l);
+            if (bl > 0)
+            {
+                // double-rotation case
+                link lr = rightOf(l);
+                int blr = balanceOf(lr);
+                counters.rotate(erasing, 2);
+                setLeft(node, rotateRight(l));
+                top = rotateLeft(node);
+                setBalance(node, blr < 0 ? 1 : 0);
+                setBalance(l, blr > 0 ? -1 : 0);
+                setBalance(top, 0);
+                shrunk = true;
+            }
+            else
+            {
+                counters.rotate(erasing);
+                top = rotateLeft(node);
+                setBalance(node, bl == 0 ? -1 : 0);
+                setBalance(top, bl == 0 ? 1 : 0);
+                shrunk = bl != 0;
+            }
+        }
+        else
+        {
+            link r = rightOf(node);
+            int br = balanceOf(r);
+            if (br < 0)
+            {
+                // double-rotation case
+                link rl = leftOf(r);
+                int brl = balanceOf(rl);
+                counters.rotate(erasing, 2);
+                setRight(node, rotateLeft(r));
+                top = rotateRight(node);
+                setBalance(node, brl > 0 ? -1 : 0);
+                setBalance(r, brl < 0 ? 1 : 0);
+                setBalance(top, 0);
+                shrunk = true;
+            }
+            else
+            {
+                counters.rotate(erasing);
+                top = rotateRight(node);
+                setBalance(node, br == 0 ? 1 : 0);
+                setBalance(top, br == 0 ? -1 : 0);
+                shrunk = br != 0;
+            }
+        }
+
+        return top;
     }
 };
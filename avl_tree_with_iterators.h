@@ -1,34 +1,237 @@
 // avl-tree
+#pragma once
 #include <iostream>
+#include <algorithm>
+#include <iterator>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
+#include "background_reclaimer.h"
+#include "frozen_tree.h"
+#include "mapped_tree.h"
+#include "tree_augment.h"
+#include "tree_stats.h"
+
+// Fixed-size slots carved from contiguous blocks. Freed slots are recycled
+// through a free list. Not thread-safe.
+class slab_pool
+{
+    struct slot { slot* next; };
+
+public:
+    slab_pool() = default;
+    slab_pool(const slab_pool&) = delete;
+    slab_pool& operator= (const slab_pool&) = delete;
+
+    ~slab_pool()
+    {
+        for (char* b : blocks)
+            ::operator delete(b);
+    }
+
+    // Slot size, fixed by the first allocation.
+    std::size_t slotSize() const noexcept { return size; }
+    // Slots currently handed out.
+    std::size_t live() const noexcept { return used; }
+
+    void* allocate(std::size_t sz)
+    {
+        if (size == 0)
+            size = std::max(sz, sizeof(slot));
+        ++used;
+        if (free)
+        {
+            slot* s = free;
+            free = s->next;
+            return s;
+        }
+        if (cur == end)
+        {
+            blocks.reserve(blocks.size() + 1);
+            cur = static_cast<char*>(::operator new(blockSlots * size));
+            end = cur + blockSlots * size;
+            blocks.push_back(cur);
+            blockSlots = std::min(2 * blockSlots, maxBlockSlots);
+        }
+        void* p = cur;
+        cur += size;
+        return p;
+    }
+
+    void deallocate(void* p) noexcept
+    {
+        --used;
+        slot* s = static_cast<slot*>(p);
+        s->next = free;
+        free = s;
+    }
+
+    // Drop every slot at once, keeping the first block for reuse.
+    void release() noexcept
+    {
+        if (blocks.empty())
+            return;
+        for (std::size_t i = 1; i < blocks.size(); ++i)
+            ::operator delete(blocks[i]);
+        blocks.resize(1);
+        cur = blocks[0];
+        end = cur + firstBlockSlots * size;
+        blockSlots = 2 * firstBlockSlots;
+        free = nullptr;
+        used = 0;
+    }
+
+private:
+    static constexpr std::size_t firstBlockSlots = 64;
+    static constexpr std::size_t maxBlockSlots = 64 * 1024;
+
+    std::size_t size = 0;
+    std::size_t used = 0;
+    std::size_t blockSlots = firstBlockSlots;
+    slot* free = nullptr;           // Recycled slots.
+    char* cur = nullptr;            // Unused part of the newest block.
+    char* end = nullptr;
+    std::vector<char*> blocks;
+};
+
+// Allocator handing out tree nodes from a slab_pool. Copies (including
+// rebound copies) share one pool.
 template <typename T>
+class node_pool
+{
+    template <typename U> friend class node_pool;
+
+public:
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    node_pool() : p(std::make_shared<slab_pool>()) { }
+    template <typename U>
+    node_pool(const node_pool<U>& a) noexcept : p(a.p) { }
+
+    T* allocate(std::size_t n)
+    {
+        if (pooled(n))
+            return static_cast<T*>(p->allocate(sizeof(T)));
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* t, std::size_t n) noexcept
+    {
+        if (pooled(n))
+            p->deallocate(t);
+        else
+            ::operator delete(t);
+    }
+
+    // Slots currently handed out.
+    std::size_t live() const noexcept { return p->live(); }
+    // Whether single objects of type T come from the slabs. The first
+    // allocation fixes the slot size, so objects of another size sharing the
+    // pool come from the heap.
+    bool pooled() const noexcept { return p->slotSize() != 0 && pooled(1); }
+    // Return all slots to the pool in O(blocks); nothing allocated from it may be used afterwards.
+    void release() noexcept { p->release(); }
+
+    template <typename U>
+    bool operator== (const node_pool<U>& a) const noexcept { return p == a.p; }
+    template <typename U>
+    bool operator!= (const node_pool<U>& a) const noexcept { return p != a.p; }
+
+private:
+    // Single objects of the pool's slot type come from the slabs, anything else from the heap.
+    bool pooled(std::size_t n) const noexcept
+    {
+        return n == 1 && alignof(T) <= alignof(std::max_align_t)
+            && (p->slotSize() == 0 || p->slotSize() == std::max(sizeof(T), sizeof(void*)));
+    }
+
+    std::shared_ptr<slab_pool> p;
+};
+
+template <typename T, typename Compare = std::less<>, typename Alloc = std::allocator<T>,
+    typename Augment = no_augment>
 class tree
 {
-    struct node {
+    static constexpr bool augmented = !std::is_same<Augment, no_augment>::value;
+
+    // Base of node holding its subtree's aggregate; empty without augmentation.
+    struct empty_slot { };
+    struct aggregate_slot { typename Augment::value_type agg; };
+
+    struct node : std::conditional_t<augmented, aggregate_slot, empty_slot> {
         T data;
         short depth = 1;
         size_t n = 1;
-        std::shared_ptr<node> parent = nullptr;
-        std::shared_ptr<node> left = nullptr;
-        std::shared_ptr<node> right = nullptr;
+        node* parent = nullptr;
+        node* left = nullptr;
+        node* right = nullptr;
 
         node() noexcept { }
-        node(const T& t) noexcept : data(t) { }
+        node(const T& t) : data(t) { }
         node(T&& t) noexcept : data(std::move(t)) { }
+        template <typename... Args>
+        explicit node(std::in_place_t, Args&&... args) : data(std::forward<Args>(args)...) { }
 
         void updateDepth() { depth = 1 + std::max(left ? left->depth : 0, right ? right->depth : 0); }
-        void updateN() { n = 1 + (left ? left->n : 0) + (right ? right->n : 0); }
+        void updateN()
+        {
+            n = 1 + (left ? left->n : 0) + (right ? right->n : 0);
+            updateAgg();
+        }
+        void updateAgg()
+        {
+            if constexpr (augmented)
+            {
+                this->agg = Augment::lift(data);
+                if (left)
+                    this->agg = Augment::combine(left->agg, this->agg);
+                if (right)
+                    this->agg = Augment::combine(this->agg, right->agg);
+            }
+        }
         short imbalance() { return (right ? right->depth : 0) - (left ? left->depth : 0); }
     };
 
+    using node_allocator = typename std::allocator_traits<Alloc>::template rebind_alloc<node>;
+    using node_traits = std::allocator_traits<node_allocator>;
+
+    // Allocators that can drop all of their nodes at once (node_pool).
+    template <typename A, typename = void>
+    struct releasable : std::false_type { };
+    template <typename A>
+    struct releasable<A, std::void_t<decltype(std::declval<A&>().release()),
+        decltype(std::declval<const A&>().live()), decltype(std::declval<const A&>().pooled())>> : std::true_type { };
+
 public:
+    using value_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+    using allocator_type = Alloc;
+
     class iterator {
         friend class tree;
 
     public:
-        iterator() { p = nullptr; }
-        iterator(std::shared_ptr<node> p) { p = p; }
-        iterator(const iterator& it) { p = it.p; }
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T*;
+        using reference = T&;
+
+        iterator() : p(nullptr) { }
+        iterator(node* p) : p(p) { }
+        iterator(const iterator& it) : p(it.p) { }
 
         iterator& operator= (const iterator& it)
         {
@@ -53,7 +256,7 @@ public:
                     p = p->left;
             }
             else {
-                std::shared_ptr<node> before;
+                node* before;
                 do {
                     before = p;
                     p = p->parent;
@@ -81,7 +284,7 @@ public:
             }
             else
             {
-                std::shared_ptr<node> before;
+                node* before;
                 do {
                     before = p;
                     p = p->parent;
@@ -101,15 +304,23 @@ public:
         T* operator-> () const { return &(p->data); }
 
     private:
-        std::shared_ptr<node> p;
+        node* p;
     };
 
     class const_iterator {
+        friend class tree;
+
     public:
-        const_iterator() { p = nullptr; }
-        const_iterator(const std::shared_ptr<node> p) { p = p; }
-        const_iterator(const const_iterator& it) { p = it.p; }
-        const_iterator(const iterator& it) { p = it.p; }
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        const_iterator() : p(nullptr) { }
+        const_iterator(const node* p) : p(p) { }
+        const_iterator(const const_iterator& it) : p(it.p) { }
+        const_iterator(const iterator& it) : p(it.p) { }
 
         const_iterator& operator= (const const_iterator& it)
         {
@@ -136,7 +347,7 @@ public:
             }
             else
             {
-                const std::shared_ptr<node> before;
+                const node* before;
                 do {
                     before = p;
                     p = p->parent;
@@ -163,7 +374,7 @@ public:
             }
             else
             {
-                const std::shared_ptr<node> before;
+                const node* before;
 
                 do {
                     before = p;
@@ -187,33 +398,149 @@ public:
         node const* p;
     };
 
-    tree() noexcept
+    // Owns a node taken out of a tree by extract(), until it is inserted into
+    // a tree with an equal allocator or destroyed.
+    class node_type {
+        friend class tree;
+
+    public:
+        node_type() { }
+        node_type(node_type&& h) noexcept : nd(h.nd), alloc(std::move(h.alloc)) { h.nd = nullptr; }
+        node_type& operator= (node_type&& h) noexcept
+        {
+            if (this != &h)
+            {
+                reset();
+                nd = h.nd;
+                alloc = std::move(h.alloc);
+                h.nd = nullptr;
+            }
+            return *this;
+        }
+        ~node_type() { reset(); }
+
+        bool empty() const noexcept { return nd == nullptr; }
+        explicit operator bool() const noexcept { return nd != nullptr; }
+        T& value() const { return nd->data; }
+        allocator_type get_allocator() const { return allocator_type(*alloc); }
+
+    private:
+        node_type(node* nd, const node_allocator& a) : nd(nd), alloc(a) { }
+
+        void reset() noexcept
+        {
+            if (nd)
+            {
+                node_traits::destroy(*alloc, nd);
+                node_traits::deallocate(*alloc, nd, 1);
+                nd = nullptr;
+            }
+        }
+
+        node* nd = nullptr;
+        std::optional<node_allocator> alloc;
+    };
+
+    tree() : tree(Compare()) { }
+    explicit tree(const Compare& c, const Alloc& a = Alloc()) : alloc(a), comp(c) { root = newHeader(); }
+    explicit tree(const Alloc& a) : tree(Compare(), a) { }
+    // Copies are deep, O(n): nodes link to their parents, so they cannot be
+    // shared between trees. persistent_tree copies in O(1).
+    tree(const tree& t)
+        : alloc(node_traits::select_on_container_copy_construction(t.alloc)), comp(t.comp)
     {
-        root = std::make_shared<node>();
-        root->n = 0;
+        root = newHeader();
+        copyFrom(t);
     }
-    tree(const tree& t) noexcept { *this = t; }
-    tree(tree&& t) noexcept
+    template <typename InputIt>
+    tree(InputIt first, InputIt last, const Compare& c = Compare(), const Alloc& a = Alloc())
+        : tree(c, a) { assign(first, last); }
+    template <typename InputIt>
+    tree(InputIt first, InputIt last, const Alloc& a) : tree(Compare(), a) { assign(first, last); }
+    tree(tree&& t) : alloc(t.alloc), comp(t.comp)
     {
         root = t.root;
-        t.root = std::make_shared<node>(); //alloc.construct(t.root);
-        t.root->n = 0;
+        t.root = t.newHeader();
+        tail = t.tail;
+        t.tail = nullptr;
     }
-    tree& operator= (const tree& t) noexcept
+    tree& operator= (const tree& t)
     {
-        root = deepCopyNode(t.root);
+        if (this != &t)
+        {
+            clear();
+            comp = t.comp;
+            copyFrom(t);
+        }
         return *this;
     }
-    tree& operator= (tree&& t) noexcept
+    tree& operator= (tree&& t)
     {
-        clear();
-        std::swap(root, t.root);
+        comp = t.comp;
+        if constexpr (node_traits::propagate_on_container_move_assignment::value)
+        {
+            clear();
+            std::swap(root, t.root);
+            std::swap(tail, t.tail);
+            std::swap(alloc, t.alloc);
+        }
+        else if (alloc == t.alloc)
+        {
+            clear();
+            std::swap(root, t.root);
+            std::swap(tail, t.tail);
+        }
+        else
+            *this = static_cast<const tree&>(t);
+        return *this;
     }
 
     ~tree() noexcept
     {
-        clearNode(root);
-        root.reset();
+        if (!dropNodes())
+            clearNode(root->left);
+        deleteNode(root);
+    }
+
+    allocator_type get_allocator() const { return allocator_type(alloc); }
+    key_compare key_comp() const { return comp; }
+    value_compare value_comp() const { return comp; }
+
+    // Replace the contents with [first, last), sorting it first unless it is already in order.
+    // With threads > 1 the sort and the build are split across that many threads.
+    template <typename InputIt>
+    void assign(InputIt first, InputIt last, unsigned threads = 1)
+    {
+        std::vector<T> v(first, last);
+        if (!std::is_sorted(v.begin(), v.end(), comp))
+            sortParallel(v, threads);
+        assign_sorted(std::make_move_iterator(v.begin()), std::make_move_iterator(v.end()), threads);
+    }
+
+    // Replace the contents with the sorted range [first, last) in linear time.
+    // Random access ranges are built by up to `threads` threads, each constructing
+    // and linking a disjoint subtree.
+    template <typename ForwardIt>
+    void assign_sorted(ForwardIt first, ForwardIt last, unsigned threads = 1)
+    {
+        clear();
+        size_t n = std::distance(first, last);
+        if constexpr (std::is_base_of<std::random_access_iterator_tag,
+            typename std::iterator_traits<ForwardIt>::iterator_category>::value)
+        {
+            if (threads > 1 && n >= parallelCutoff)
+                root->left = buildParallel(first, n, threads);
+            else
+                root->left = buildNode(first, n);
+        }
+        else
+            root->left = buildNode(first, n);
+        if (root->left)
+        {
+            root->left->parent = root;
+            root->depth = 1 + root->left->depth;
+        }
+        root->n = n;
     }
 
     bool operator== (const tree& t) const
@@ -233,21 +560,21 @@ public:
 
     iterator begin()
     {
-        std::shared_ptr<node> p = root;
+        node* p = root;
         while (p->left)
             p = p->left;
         return iterator(p);
     }
     const_iterator begin() const
     {
-        const std::shared_ptr<node> p = root;
+        const node* p = root;
         while (p->left)
             p = p->left;
         return const_iterator(p);
     }
     const_iterator cbegin() const
     {
-        const std::shared_ptr<node> p = root;
+        const node* p = root;
         while (p->left)
             p = p->left;
         return const_iterator(p);
@@ -268,155 +595,119 @@ public:
         return *b;
     }
 
-    T& back()
-    {
-        iterator b = end();
-        return *(--b);
-    }
+    T& back() { return lastNode()->data; }
     const T& back() const
     {
+        if (tail)
+            return tail->data;
         const_iterator b = end();
         return *(--b);
     }
 
-    iterator insert(const T& t)
+    iterator insert(const T& t) { return insertNode(newNode(t)); }
+    iterator insert(T&& t) { return insertNode(newNode(std::move(t))); }
+
+    // Construct the element in its node from args.
+    template <typename... Args>
+    iterator emplace(Args&&... args) { return insertNode(newNode(std::in_place, std::forward<Args>(args)...)); }
+
+    // Insert searching from hint rather than from the root: an element d places
+    // from the hint costs O(log d) comparisons, and rebalancing is amortized
+    // O(1). end() starts from the last element, which is cached, so appends
+    // and nearly sorted input insert in O(1) comparisons. Either way the
+    // element ends up where insert(t) would put it.
+    iterator insert(const_iterator hint, const T& t) { return insertNodeHint(hint, newNode(t)); }
+    iterator insert(const_iterator hint, T&& t) { return insertNodeHint(hint, newNode(std::move(t))); }
+    template <typename... Args>
+    iterator emplace_hint(const_iterator hint, Args&&... args)
     {
-        iterator res;
-        // descent the search tree
-        std::shared_ptr<node> parent = root;
-        while (true)
+        return insertNodeHint(hint, newNode(std::in_place, std::forward<Args>(args)...));
+    }
+
+    // Relink an extracted node without allocating; returns end() for an empty handle.
+    iterator insert(node_type&& h)
+    {
+        if (h.empty())
+            return end();
+        if (!(*h.alloc == alloc))
         {
-            ++parent->n;
-            if (parent == root || t < parent->data)
-            {
-                if (parent->left)
-                {
-                    parent = parent->left;
-                }
-                else
-                {
-                    parent->left = std::make_shared<node>(t);
-                    parent->left->parent = parent;
-                    res = iterator(parent->left);
-                    break;
-                }
-            }
-            else
-            {
-                if (parent->right)
-                {
-                    parent = parent->right;
-                }
-                else
-                {
-                    parent->right = std::make_shared<node>(t);
-                    parent->right->parent = parent;
-                    res = iterator(parent->right);
-                    break;
-                }
-            }
+            iterator it = insert(std::move(h.value()));
+            h.reset();
+            return it;
         }
-        short branch_depth = 1;
-        do
-        {
-            if (parent->depth > branch_depth)
-                break;
-            parent->depth = 1 + branch_depth;
-            if (parent == root)
-                break;
-            if (parent->imbalance() < -1)
-            {
-                // check for double-rotation case
-                if (parent->left->imbalance() > 0)
-                    rotateLeft(parent->left);
-                rotateRight(parent);
-                break;
-            }
-            else if (parent->imbalance() > 1)
-            {
-                // check for double-rotation case
-                if (parent->right->imbalance() < 0)
-                    rotateRight(parent->right);
-                rotateLeft(parent);
-                break;
-            }
+        node* nd = h.nd;
+        h.nd = nullptr;
+        nd->parent = nd->left = nd->right = nullptr;
+        nd->n = 1;
+        nd->depth = 1;
+        return insertNode(nd);
+    }
 
-            branch_depth = parent->depth;
-            parent = parent->parent;
-        } while (parent);
-        return res;
+    // Unlink an element and hand over its node; the tree no longer owns it.
+    node_type extract(const_iterator it)
+    {
+        node* p = const_cast<node*>(it.p);
+        const_iterator next(it);
+        ++next;
+        return node_type(unlinkNode(p, const_cast<node*>(next.p)), alloc);
+    }
+    // Extract the first element equivalent to t, if any.
+    node_type extract(const T& t)
+    {
+        iterator it = find(t);
+        return it == end() ? node_type() : extract(const_iterator(it));
     }
 
-    iterator insert(T&& t)
+    // Move every element of t here, after equal elements already present,
+    // relinking its nodes in O(m log(n / m + 1)) when the allocators are equal.
+    void merge(tree& t)
     {
-        iterator res;
-        // descent the search tree
-        std::shared_ptr<node> parent = root;
-        while (true)
+        if (this == &t || t.empty())
+            return;
+        if (!(alloc == t.alloc))
         {
-            ++parent->n;
-            if (parent == root || t < parent->data)
-            {
-                if (parent->left)
-                {
-                    parent = parent->left;
-                }
-                else
-                {
-                    parent->left = std::move(t);
-                    parent->left->parent = parent;
-                    res = iterator(parent->left);
-                    break;
-                }
-            }
-            else
-            {
-                if (parent->right)
-                {
-                    parent = parent->right;
-                }
-                else
-                {
-                    parent->right = std::move(t);
-                    parent->right->parent = parent;
-                    res = iterator(parent->right);
-                    break;
-                }
-            }
+            insert_batch(std::make_move_iterator(t.begin()), std::make_move_iterator(t.end()));
+            t.clear();
+            return;
         }
+        std::vector<node*> nodes;
+        nodes.reserve(t.size());
+        for (iterator it = t.begin(); it != t.end(); ++it)
+            nodes.push_back(it.p);
+        t.detach();
+        // mergeNodes relinks children but expects subtree roots without a parent
+        for (node* nd : nodes)
+            nd->parent = nullptr;
+        counters.insert(nodes.size());
+        attach(mergeNodes(detach(), nodes.data(), nodes.data() + nodes.size()));
+    }
+    void merge(tree&& t) { merge(t); }
 
-        short branch_depth = 1;
-        do
+    // Insert [first, last) in one pass: the batch is sorted and routed down the
+    // tree together, so nodes on shared path prefixes are visited and rebalanced
+    // once, in O(m log(n / m + 1)) overall. As with insert, new elements go after
+    // equal ones already present.
+    template <typename InputIt>
+    void insert_batch(InputIt first, InputIt last)
+    {
+        std::vector<T> v(first, last);
+        if (!std::is_sorted(v.begin(), v.end(), comp))
+            std::stable_sort(v.begin(), v.end(), comp);
+        std::vector<node*> nodes;
+        nodes.reserve(v.size());
+        try
         {
-            if (parent->depth > branch_depth)
-                break;
-
-            parent->depth = 1 + branch_depth;
-
-            if (parent == root)
-                break;
-
-            if (parent->imbalance() < -1)
-            {
-                // check for double-rotation case
-                if (parent->left->imbalance() > 0)
-                    rotateLeft(parent->left);
-                rotateRight(parent);
-                break;
-            }
-            else if (parent->imbalance() > 1)
-            {
-                // check for double-rotation case
-                if (parent->right->imbalance() < 0)
-                    rotateRight(parent->right);
-                rotateLeft(parent);
-                break;
-            }
-
-            branch_depth = parent->depth;
-            parent = parent->parent;
-        } while (parent);
-        return res;
+            for (T& t : v)
+                nodes.push_back(newNode(std::move(t)));
+        }
+        catch (...)
+        {
+            for (node* nd : nodes)
+                deleteNode(nd);
+            throw;
+        }
+        counters.insert(nodes.size());
+        attach(mergeNodes(detach(), nodes.data(), nodes.data() + nodes.size()));
     }
 
     iterator at(size_t i)
@@ -425,7 +716,7 @@ public:
         if (i >= size())
             throw std::out_of_range("tree::at out-of-range");
         size_t j = i;
-        std::shared_ptr<node> p = root->left;
+        node* p = root->left;
         while (true)
         {
             if (p->left)
@@ -465,7 +756,7 @@ public:
         if (i >= size())
             throw std::out_of_range("tree[] out-of-range");
         size_t j = i;
-        const std::shared_ptr<node> p = root->left;
+        const node* p = root->left;
         while (true)
         {
             if (p->left)
@@ -507,57 +798,600 @@ public:
     {
         iterator itn(it);
         ++itn;
-        std::shared_ptr<node> p = it.p;
-        std::shared_ptr<node> q;
-        if (!p->left || !p->right)
-            q = p;
-        else
-            q = itn.p;
-        std::shared_ptr<node> s;
-        if (q->left)
+        deleteNode(unlinkNode(it.p, itn.p));
+        return itn;
+    }
+
+    // Erase [first, last) by splitting it out and joining what remains, in
+    // O(log n) plus the cost of freeing the k erased nodes; short ranges are
+    // erased one at a time. Returns last, which stays valid.
+    iterator erase(iterator first, iterator last)
+    {
+        size_t i = rank(first);
+        size_t k = rank(last) - i;
+        if (k < bulkEraseCutoff)
         {
-            s = q->left;
-            q->left = nullptr;
+            while (first != last)
+                first = erase(first);
+            return last;
         }
-        else
+        counters.erase(k);
+        clearNode(cutNodes(i, k));
+        return last;
+    }
+
+    // Erase the elements in [lo, hi); returns how many there were.
+    size_t erase_range(const T& lo, const T& hi)
+    {
+        if (!comp(lo, hi))
+            return 0;
+        size_t n = size();
+        erase(lower_bound(lo), lower_bound(hi));
+        return n - size();
+    }
+
+    // Move the elements in [lo, hi) into the returned tree in O(log n). It
+    // shares this tree's allocator; clear(background_reclaimer&) on it frees
+    // the nodes off the caller's thread when that is safe for the allocator.
+    tree extract_range(const T& lo, const T& hi)
+    {
+        tree t(comp, get_allocator());
+        if (comp(lo, hi))
         {
-            s = q->right;
-            q->right = nullptr;
+            size_t i = rank(lo);
+            t.attach(cutNodes(i, rank(hi) - i));
+        }
+        return t;
+    }
+
+    // Lookups descend with a single comparison per level, lower_bound style,
+    // and test for equivalence once at the end. The template overloads accept
+    // any key type when Compare is transparent.
+    iterator find(const T& t) { return iterator(findNode(t)); }
+    const_iterator find(const T& t) const { return const_iterator(findNode(t)); }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator find(const K& k) { return iterator(findNode(k)); }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    const_iterator find(const K& k) const { return const_iterator(findNode(k)); }
+
+    bool contains(const T& t) const { return findNode(t) != root; }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    bool contains(const K& k) const { return findNode(k) != root; }
+
+    // Write find(k) for each key of [first, last) to out, in input order. The keys
+    // are sorted and routed down the tree together, so shared path prefixes are
+    // walked once.
+    template <typename InputIt, typename OutputIt>
+    OutputIt find_batch(InputIt first, InputIt last, OutputIt out)
+    {
+        for (node* p : findBatchNodes(std::vector<typename std::iterator_traits<InputIt>::value_type>(first, last)))
+            *out++ = iterator(p);
+        return out;
+    }
+    template <typename InputIt, typename OutputIt>
+    OutputIt find_batch(InputIt first, InputIt last, OutputIt out) const
+    {
+        for (node* p : findBatchNodes(std::vector<typename std::iterator_traits<InputIt>::value_type>(first, last)))
+            *out++ = const_iterator(p);
+        return out;
+    }
+
+    // First element not less than t.
+    iterator lower_bound(const T& t) { return iterator(lowerBoundNode(t)); }
+    const_iterator lower_bound(const T& t) const { return const_iterator(lowerBoundNode(t)); }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator lower_bound(const K& k) { return iterator(lowerBoundNode(k)); }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    const_iterator lower_bound(const K& k) const { return const_iterator(lowerBoundNode(k)); }
+
+    // First element greater than t.
+    iterator upper_bound(const T& t) { return iterator(upperBoundNode(t)); }
+    const_iterator upper_bound(const T& t) const { return const_iterator(upperBoundNode(t)); }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator upper_bound(const K& k) { return iterator(upperBoundNode(k)); }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    const_iterator upper_bound(const K& k) const { return const_iterator(upperBoundNode(k)); }
+
+    // The elements equivalent to t.
+    std::pair<iterator, iterator> equal_range(const T& t) { return { lower_bound(t), upper_bound(t) }; }
+    std::pair<const_iterator, const_iterator> equal_range(const T& t) const { return { lower_bound(t), upper_bound(t) }; }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    std::pair<iterator, iterator> equal_range(const K& k) { return { lower_bound(k), upper_bound(k) }; }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    std::pair<const_iterator, const_iterator> equal_range(const K& k) const { return { lower_bound(k), upper_bound(k) }; }
+
+    // Rank queries use the subtree sizes and take O(log n) whatever the answer.
+
+    // Number of elements less than t, which is also the index of lower_bound(t).
+    size_t rank(const T& t) const { return countBefore(t, false); }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    size_t rank(const K& k) const { return countBefore(k, false); }
+
+    // Index of the element at it; size() for end().
+    size_t rank(const_iterator it) const
+    {
+        const node* p = it.p;
+        if (p == root)
+            return size();
+        size_t i = p->left ? p->left->n : 0;
+        for (; p->parent != root; p = p->parent)
+            if (p == p->parent->right)
+                i += 1 + (p->parent->left ? p->parent->left->n : 0);
+        return i;
+    }
+    size_t rank(iterator it) const { return rank(const_iterator(it)); }
+
+    // Number of elements equivalent to t.
+    size_t count(const T& t) const { return countBefore(t, true) - countBefore(t, false); }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    size_t count(const K& k) const { return countBefore(k, true) - countBefore(k, false); }
+
+    // Number of elements in [lo, hi).
+    size_t count(const T& lo, const T& hi) const { return comp(lo, hi) ? countBefore(hi, false) - countBefore(lo, false) : 0; }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    size_t count(const K& lo, const K& hi) const { return comp(lo, hi) ? countBefore(hi, false) - countBefore(lo, false) : 0; }
+
+    // Augment's combination of all elements, or of those in [lo, hi), in O(log n).
+    template <typename A = Augment, typename = std::enable_if_t<!std::is_same<A, no_augment>::value>>
+    typename A::value_type aggregate() const { return root->left ? root->left->agg : Augment::identity(); }
+    template <typename A = Augment, typename = std::enable_if_t<!std::is_same<A, no_augment>::value>>
+    typename A::value_type aggregate(const T& lo, const T& hi) const { return aggregateRange(lo, hi); }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent,
+        typename A = Augment, typename = std::enable_if_t<!std::is_same<A, no_augment>::value>>
+    typename A::value_type aggregate(const K& lo, const K& hi) const { return aggregateRange(lo, hi); }
+
+    // Read-optimized copy of the current contents, see frozen_tree.h. The second
+    // form refreshes an existing snapshot in linear time, reusing its storage.
+    frozen_tree<T, Compare> freeze() const { return frozen_tree<T, Compare>(cbegin(), cend(), comp); }
+    void freeze(frozen_tree<T, Compare>& f) const { f.assign_sorted(cbegin(), cend()); }
+
+    // Write the elements to path for mapped_tree to serve in place; T must be
+    // trivially copyable. load() rebuilds a tree from such a file in linear time.
+    void save(const std::string& path) const
+    {
+        save_mapped_tree<T, Compare>(path, size(), [&](T* out) { std::copy(cbegin(), cend(), out); });
+    }
+    static tree load(const std::string& path, const Compare& c = Compare(), const Alloc& a = Alloc())
+    {
+        mapped_tree<T, Compare> m(path, true, c);
+        tree t(c, a);
+        t.assign_sorted(m.begin(), m.end());
+        return t;
+    }
+
+    // Erase every element equivalent to t; returns how many there were.
+    size_t remove(const T& t)
+    {
+        std::pair<iterator, iterator> r = equal_range(t);
+        size_t n = size();
+        erase(r.first, r.second);
+        return n - size();
+    }
+
+    void clear() noexcept
+    {
+        tail = nullptr;
+        if (dropNodes())
+            return;
+        clearNode(root->left);
+        root->left = nullptr;
+        root->n = 0;
+        root->depth = 1;
+    }
+
+    // Empty the tree at once and leave freeing the nodes to r's thread. Only
+    // std::allocator is known to be safe for that: other allocators, such as
+    // node_pool, may share state that this tree keeps using, so with them the
+    // nodes are freed here as by clear().
+    void clear(background_reclaimer& r)
+    {
+        if constexpr (std::is_same<node_allocator, std::allocator<node>>::value)
+        {
+            if (!empty())
+                r.retire(tree(std::move(*this)));
         }
-        if (s)
-            s->parent = q->parent;
-        if (q == q->parent->left)
-            q->parent->left = s;
         else
-            q->parent->right = s;
-        std::shared_ptr<node> q_parent = q->parent;
-        if (q != p)
+            clear();
+    }
+
+    // Move the elements not less than key into the returned tree, in O(log n).
+    tree split(const T& key)
+    {
+        node* l;
+        node* r;
+        splitNode(detach(), [&](const T& x) { return comp(x, key); }, l, r);
+        attach(l);
+        tree t(comp, get_allocator());
+        t.attach(r);
+        return t;
+    }
+
+    // Concatenate left, pivot and right, where no element of left is greater than
+    // pivot and no element of right is less than it, in O(log n).
+    static tree join(tree&& left, T pivot, tree&& right)
+    {
+        node* r = left.adoptNodes(right);
+        node* k;
+        try
         {
-            q->parent = p->parent;
-            if (q->parent->left == p)
-                q->parent->left = q;
+            k = left.newNode(std::move(pivot));
+        }
+        catch (...)
+        {
+            left.clearNode(r);
+            throw;
+        }
+        left.attach(joinNodes(left.detach(), k, r));
+        return std::move(left);
+    }
+
+    // Concatenate left and right, where no element of left is greater than any of right.
+    static tree join(tree&& left, tree&& right)
+    {
+        node* r = left.adoptNodes(right);
+        left.attach(joinNodes(left.detach(), r));
+        return std::move(left);
+    }
+
+    // Set operations in O(m log(n / m + 1)), relinking the nodes of both trees.
+    // With threads > 1 the recursion on large subtrees is forked across threads.
+
+    // Add the elements of t whose key is not already present.
+    void unite(tree&& t, unsigned threads = 1)
+    {
+        node* b = adoptNodes(t);
+        std::vector<node*> dropped;
+        attach(uniteNodes(detach(), b, threads, dropped));
+        for (node* d : dropped)
+            clearNode(d);
+    }
+    void unite(const tree& t, unsigned threads = 1) { unite(copyOf(t), threads); }
+
+    // Keep one element of each key that is also present in t.
+    void intersect(tree&& t, unsigned threads = 1)
+    {
+        node* b = adoptNodes(t);
+        std::vector<node*> dropped;
+        attach(intersectNodes(detach(), b, threads, dropped));
+        for (node* d : dropped)
+            clearNode(d);
+    }
+    void intersect(const tree& t, unsigned threads = 1) { intersect(copyOf(t), threads); }
+
+    // Drop every element whose key is present in t.
+    void subtract(tree&& t, unsigned threads = 1)
+    {
+        node* b = adoptNodes(t);
+        std::vector<node*> dropped;
+        attach(subtractNodes(detach(), b, threads, dropped));
+        for (node* d : dropped)
+            clearNode(d);
+    }
+    void subtract(const tree& t, unsigned threads = 1) { subtract(copyOf(t), threads); }
+
+    void swap(tree& t)
+    {
+        std::swap(root, t.root);
+        std::swap(tail, t.tail);
+        std::swap(comp, t.comp);
+        if constexpr (node_traits::propagate_on_container_swap::value)
+            std::swap(alloc, t.alloc);
+    }
+
+    size_t size() const { return root->n; }
+    bool empty() const { return root->left == nullptr; }
+
+    // Operation counters (with AVL_TREE_STATS) and the current shape.
+    tree_stats stats() const
+    {
+        tree_stats s;
+        counters.read(s);
+        s.size = size();
+        s.bytes = (size() + 1) * sizeof(node);
+        std::vector<std::pair<const node*, size_t>> stack;
+        if (root->left)
+            stack.emplace_back(root->left, 0);
+        while (!stack.empty())
+        {
+            const node* p = stack.back().first;
+            size_t d = stack.back().second;
+            stack.pop_back();
+            if (s.levels.size() <= d)
+                s.levels.resize(d + 1);
+            ++s.levels[d];
+            if (p->left)
+                stack.emplace_back(p->left, d + 1);
+            if (p->right)
+                stack.emplace_back(p->right, d + 1);
+        }
+        s.height = s.levels.size();
+        return s;
+    }
+    void reset_stats() { counters.reset(); }
+
+private:
+    template <typename... Args>
+    node* newNode(Args&&... args)
+    {
+        node* nd = node_traits::allocate(alloc, 1);
+        try
+        {
+            node_traits::construct(alloc, nd, std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            node_traits::deallocate(alloc, nd, 1);
+            throw;
+        }
+        return nd;
+    }
+
+    node* newHeader()
+    {
+        node* nd = newNode();
+        nd->n = 0;
+        return nd;
+    }
+
+    void deleteNode(node* nd) noexcept
+    {
+        node_traits::destroy(alloc, nd);
+        node_traits::deallocate(alloc, nd, 1);
+    }
+
+    template <typename K>
+    node* lowerBoundNode(const K& k) const
+    {
+        node* res = root;
+        node* p = root->left;
+        while (p)
+        {
+            counters.compare();
+            if (comp(p->data, k))
+            {
+                p = p->right;
+            }
             else
-                q->parent->right = q;
-            q->left = p->left;
+            {
+                res = p;
+                p = p->left;
+            }
+        }
+        return res;
+    }
 
-            if (q->left)
-                q->left->parent = q;
-            q->right = p->right;
-            if (q->right)
-                q->right->parent = q;
-            q->n = p->n;
-            q->depth = p->depth;
-            p->left = nullptr;
-            p->right = nullptr;
+    template <typename K>
+    node* upperBoundNode(const K& k) const
+    {
+        node* res = root;
+        node* p = root->left;
+        while (p)
+        {
+            counters.compare();
+            if (comp(k, p->data))
+            {
+                res = p;
+                p = p->left;
+            }
+            else
+            {
+                p = p->right;
+            }
         }
-        if (q_parent == p)
-            q_parent = q;
-        std::shared_ptr<node> parent;
-        for (parent = q_parent; parent; parent = parent->parent)
-            --parent->n;
-        for (parent = q_parent; parent; parent = parent->parent)
+        return res;
+    }
+
+    // Number of elements less than k, or not greater than k with inclusive.
+    template <typename K>
+    size_t countBefore(const K& k, bool inclusive) const
+    {
+        size_t i = 0;
+        const node* p = root->left;
+        while (p)
+        {
+            counters.compare();
+            if (inclusive ? !comp(k, p->data) : comp(p->data, k))
+            {
+                i += 1 + (p->left ? p->left->n : 0);
+                p = p->right;
+            }
+            else
+            {
+                p = p->left;
+            }
+        }
+        return i;
+    }
+
+    template <typename K, typename A = Augment>
+    typename A::value_type aggregateRange(const K& lo, const K& hi) const
+    {
+        if (!comp(lo, hi))
+            return A::identity();
+        // descend to the highest node inside the range
+        const node* p = root->left;
+        while (p)
+        {
+            if (comp(p->data, lo))
+                p = p->right;
+            else if (!comp(p->data, hi))
+                p = p->left;
+            else
+                break;
+        }
+        if (!p)
+            return A::identity();
+        // elements not less than lo on its left, found right to left
+        typename A::value_type left = A::identity();
+        for (const node* q = p->left; q; )
         {
-            parent->update_depth();
+            if (comp(q->data, lo))
+                q = q->right;
+            else
+            {
+                left = A::combine(q->right ? A::combine(A::lift(q->data), q->right->agg) : A::lift(q->data), left);
+                q = q->left;
+            }
+        }
+        // elements less than hi on its right, found left to right
+        typename A::value_type right = A::identity();
+        for (const node* q = p->right; q; )
+        {
+            if (!comp(q->data, hi))
+                q = q->left;
+            else
+            {
+                right = A::combine(right, q->left ? A::combine(q->left->agg, A::lift(q->data)) : A::lift(q->data));
+                q = q->right;
+            }
+        }
+        return A::combine(A::combine(left, A::lift(p->data)), right);
+    }
+
+    template <typename K>
+    node* findNode(const K& k) const
+    {
+        counters.find();
+        node* p = lowerBoundNode(k);
+        if (p == root)
+            return root;
+        counters.compare();
+        return !comp(k, p->data) ? p : root;
+    }
+
+    iterator insertNode(node* nd)
+    {
+        const T& t = nd->data;
+        // descent the search tree
+        node* parent = root;
+        bool last = true;
+        while (true)
+        {
+            ++parent->n;
+            if (parent == root || comp(t, parent->data))
+            {
+                last = last && parent == root;
+                if (parent->left)
+                {
+                    parent = parent->left;
+                }
+                else
+                {
+                    parent->left = nd;
+                    break;
+                }
+            }
+            else
+            {
+                if (parent->right)
+                {
+                    parent = parent->right;
+                }
+                else
+                {
+                    parent->right = nd;
+                    break;
+                }
+            }
+        }
+        nd->parent = parent;
+        if (last)
+            tail = nd;
+        if constexpr (augmented)
+        {
+            nd->updateAgg();
+            for (node* p = parent; p != root; p = p->parent)
+                p->updateAgg();
+        }
+        rebalanceInsert(parent);
+        return iterator(nd);
+    }
+
+    node* lastNode()
+    {
+        if (!tail && root->left)
+            for (tail = root->left; tail->right; tail = tail->right)
+                ;
+        return tail;
+    }
+
+    // Climb from the hint to the lowest ancestor whose subtree holds the
+    // element's place, then descend from there. Only the bound on the
+    // element's side of the hint can fail, so that is the only one checked.
+    iterator insertNodeHint(const_iterator hint, node* nd)
+    {
+        node* s = const_cast<node*>(hint.p);
+        if (s == root && !(s = lastNode()))
+            return insertNode(nd);
+        const T& t = nd->data;
+        counters.compare();
+        bool before = comp(t, s->data);
+        if (!before)
+        {
+            // appending is common enough to check the last element first
+            node* last = lastNode();
+            if (last != s)
+                counters.compare();
+            if (last == s || !comp(t, last->data))
+                return linkNode(last, false, nd);
+        }
+        node* p = s;
+        bool adjacent = true;
+        for (node* q = p->parent; q != root; p = q, q = q->parent)
+        {
+            if ((p == q->right) == before)
+            {
+                counters.compare();
+                if (before != comp(t, q->data))
+                    break;
+                adjacent = false;
+            }
+        }
+        if (adjacent && !(before ? s->left : s->right))
+            return linkNode(s, before, nd);
+        bool left;
+        while (true)
+        {
+            counters.compare();
+            left = comp(t, p->data);
+            node* c = left ? p->left : p->right;
+            if (!c)
+                break;
+            p = c;
+        }
+        return linkNode(p, left, nd);
+    }
+
+    // Hang nd as the given child of parent, where it was found to belong in order.
+    iterator linkNode(node* parent, bool left, node* nd)
+    {
+        (left ? parent->left : parent->right) = nd;
+        nd->parent = parent;
+        if (!left && parent == tail)
+            tail = nd;
+        for (node* p = parent; p; p = p->parent)
+            ++p->n;
+        if constexpr (augmented)
+        {
+            nd->updateAgg();
+            for (node* p = parent; p != root; p = p->parent)
+                p->updateAgg();
+        }
+        rebalanceInsert(parent);
+        return iterator(nd);
+    }
+
+    // Restore depths and balance from the parent of a new leaf upward.
+    void rebalanceInsert(node* parent)
+    {
+        counters.insert();
+        short branch_depth = 1;
+        do
+        {
+            counters.retrace(false);
+            if (parent->depth > branch_depth)
+                break;
+            parent->depth = 1 + branch_depth;
             if (parent == root)
                 break;
             if (parent->imbalance() < -1)
@@ -565,8 +1399,10 @@ public:
                 // check for double-rotation case
                 if (parent->left->imbalance() > 0)
                 {
+                    counters.rotate(false);
                     rotateLeft(parent->left);
                 }
+                counters.rotate(false);
                 rotateRight(parent);
                 break;
             }
@@ -575,67 +1411,526 @@ public:
                 // check for double-rotation case
                 if (parent->right->imbalance() < 0)
                 {
+                    counters.rotate(false);
                     rotateRight(parent->right);
                 }
+                counters.rotate(false);
                 rotateLeft(parent);
                 break;
             }
+
+            branch_depth = parent->depth;
+            parent = parent->parent;
+        } while (parent);
+    }
+
+    // Lower bounds of keys[*lo] .. keys[*(hi - 1)], which are in ascending order, within
+    // subtree p; bound is the answer if every key is greater than p's elements.
+    template <typename K>
+    void lowerBoundBatch(node* p, node* bound, const std::vector<K>& keys,
+        const size_t* lo, const size_t* hi, std::vector<node*>& found) const
+    {
+        for (; p && lo != hi; p = p->right)
+        {
+            const size_t* mid = std::partition_point(lo, hi, [&](size_t i) { return !comp(p->data, keys[i]); });
+            lowerBoundBatch(p->left, p, keys, lo, mid, found);
+            lo = mid;
         }
-        p.reset();
-        return itn;
+        for (; lo != hi; ++lo)
+            found[*lo] = bound;
     }
 
-    iterator find(const T& t)
+    template <typename K>
+    std::vector<node*> findBatchNodes(const std::vector<K>& keys) const
     {
-        std::shared_ptr<node> p = root->left;
-        while (p)
+        std::vector<size_t> order(keys.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return comp(keys[a], keys[b]); });
+        std::vector<node*> found(keys.size());
+        lowerBoundBatch(root->left, root, keys, order.data(), order.data() + order.size(), found);
+        for (size_t i = 0; i < found.size(); ++i)
         {
-            if (t == p->data)
+            counters.find();
+            if (found[i] != root && comp(keys[i], found[i]->data))
+                found[i] = root;
+        }
+        return found;
+    }
+
+    // Restore depths and balance from p up to the root after a removal,
+    // stopping once a subtree keeps its previous depth.
+    void retrace(node* p)
+    {
+        while (p != root)
+        {
+            counters.retrace(true);
+            short depth = p->depth;
+            p->updateDepth();
+            if (p->imbalance() < -1)
             {
-                return iterator(p);
+                // check for double-rotation case
+                if (p->left->imbalance() > 0)
+                {
+                    counters.rotate(true);
+                    rotateLeft(p->left);
+                }
+                counters.rotate(true);
+                rotateRight(p);
+                p = p->parent;
             }
-            else if (t < p->data)
+            else if (p->imbalance() > 1)
             {
-                p = p->left;
+                // check for double-rotation case
+                if (p->right->imbalance() < 0)
+                {
+                    counters.rotate(true);
+                    rotateRight(p->right);
+                }
+                counters.rotate(true);
+                rotateLeft(p);
+                p = p->parent;
             }
+            if (p->depth == depth)
+                break;
+            p = p->parent;
+        }
+    }
+
+    // Take the root subtree out of the header, leaving this tree empty.
+    node* detach() noexcept
+    {
+        tail = nullptr;
+        node* p = root->left;
+        root->left = nullptr;
+        root->n = 0;
+        root->depth = 1;
+        if (p)
+            p->parent = nullptr;
+        return p;
+    }
+
+    // Hang a detached subtree under the header.
+    void attach(node* p) noexcept
+    {
+        tail = nullptr;
+        root->left = p;
+        root->n = p ? p->n : 0;
+        root->depth = 1 + (p ? p->depth : 0);
+        if (p)
+            p->parent = root;
+    }
+
+    // Detach the nodes of t for relinking here, first copying them if our allocator cannot free them.
+    node* adoptNodes(tree& t)
+    {
+        if (alloc == t.alloc)
+            return t.detach();
+        auto it = std::make_move_iterator(t.begin());
+        node* p = buildNode(it, t.size());
+        t.clear();
+        if (p)
+            p->parent = nullptr;
+        return p;
+    }
+
+    tree copyOf(const tree& t) const
+    {
+        tree c(comp, get_allocator());
+        c.assign_sorted(t.cbegin(), t.cend());
+        return c;
+    }
+
+    static short depthOf(const node* p) { return p ? p->depth : 0; }
+
+    // Recompute n and depth of p and rotate if it is out of balance; returns the subtree root.
+    static node* rebalance(node* p)
+    {
+        p->updateN();
+        p->updateDepth();
+        if (p->imbalance() < -1)
+        {
+            // check for double-rotation case
+            if (p->left->imbalance() > 0)
+                rotateLeft(p->left);
+            rotateRight(p);
+            return p->parent;
+        }
+        else if (p->imbalance() > 1)
+        {
+            // check for double-rotation case
+            if (p->right->imbalance() < 0)
+                rotateRight(p->right);
+            rotateLeft(p);
+            return p->parent;
+        }
+        return p;
+    }
+
+    // Rebalance from p up to the root of its detached tree and return that root.
+    static node* rebalanceUp(node* p)
+    {
+        node* top = p;
+        while (p)
+        {
+            top = rebalance(p);
+            p = top->parent;
+        }
+        return top;
+    }
+
+    // Join detached subtrees l and r around k, where l <= k <= r, in O(|depth(l) - depth(r)|).
+    static node* joinNodes(node* l, node* k, node* r)
+    {
+        node* p = nullptr;
+        node* c;
+        bool right = depthOf(l) > depthOf(r) + 1;
+        bool left = depthOf(r) > depthOf(l) + 1;
+        // descend the spine of the taller tree to a subtree as tall as the other one
+        if (right)
+        {
+            for (c = l; depthOf(c) > depthOf(r) + 1; c = c->right)
+                p = c;
+            l = c;
+        }
+        else if (left)
+        {
+            for (c = r; depthOf(c) > depthOf(l) + 1; c = c->left)
+                p = c;
+            r = c;
+        }
+        k->left = l;
+        if (l)
+            l->parent = k;
+        k->right = r;
+        if (r)
+            r->parent = k;
+        k->parent = p;
+        k->updateN();
+        k->updateDepth();
+        if (!p)
+            return k;
+        if (right)
+            p->right = k;
+        else
+            p->left = k;
+        return rebalanceUp(p);
+    }
+
+    // Join detached subtrees l and r, where l <= r.
+    static node* joinNodes(node* l, node* r)
+    {
+        if (!r)
+            return l;
+        if (!l)
+            return r;
+        // unlink the least node of r and use it as the pivot
+        node* k = r;
+        while (k->left)
+            k = k->left;
+        node* p = k->parent;
+        if (k->right)
+            k->right->parent = p;
+        if (p)
+        {
+            p->left = k->right;
+            r = rebalanceUp(p);
+        }
+        else
+        {
+            r = k->right;
+        }
+        return joinNodes(l, k, r);
+    }
+
+    // Split detached subtree t into the elements for which goesLeft holds and the rest.
+    // goesLeft must be true for a prefix of the in-order sequence.
+    template <typename Pred>
+    static void splitNode(node* t, Pred goesLeft, node*& l, node*& r)
+    {
+        if (!t)
+        {
+            l = r = nullptr;
+            return;
+        }
+        node* tl = t->left;
+        node* tr = t->right;
+        if (tl)
+            tl->parent = nullptr;
+        if (tr)
+            tr->parent = nullptr;
+        if (goesLeft(t->data))
+        {
+            node* rl;
+            splitNode(tr, goesLeft, rl, r);
+            l = joinNodes(tl, t, rl);
+        }
+        else
+        {
+            node* lr;
+            splitNode(tl, goesLeft, l, lr);
+            r = joinNodes(lr, t, tr);
+        }
+    }
+
+    // Take p out of the tree and rebalance; next is its successor.
+    node* unlinkNode(node* p, node* next)
+    {
+        counters.erase();
+        if (p == tail)
+            tail = nullptr;
+        node* q;
+        if (!p->left || !p->right)
+            q = p;
+        else
+            q = next;
+        node* s;
+        if (q->left)
+        {
+            s = q->left;
+            q->left = nullptr;
+        }
+        else
+        {
+            s = q->right;
+            q->right = nullptr;
+        }
+        if (s)
+            s->parent = q->parent;
+        if (q == q->parent->left)
+            q->parent->left = s;
+        else
+            q->parent->right = s;
+        node* q_parent = q->parent;
+        if (q != p)
+        {
+            q->parent = p->parent;
+            if (q->parent->left == p)
+                q->parent->left = q;
             else
-            {
-                p = p->right;
-            }
+                q->parent->right = q;
+            q->left = p->left;
+
+            if (q->left)
+                q->left->parent = q;
+            q->right = p->right;
+            if (q->right)
+                q->right->parent = q;
+            q->n = p->n;
+            q->depth = p->depth;
+            p->left = nullptr;
+            p->right = nullptr;
+        }
+        if (q_parent == p)
+            q_parent = q;
+        node* parent;
+        for (parent = q_parent; parent; parent = parent->parent)
+        {
+            --parent->n;
+            if (parent != root)
+                parent->updateAgg();
         }
-        return end();
+        retrace(q_parent);
+        return p;
     }
 
-    void remove(const T& t)
+    // Split detached subtree t into its first k elements and the rest.
+    static void splitNodeAt(node* t, size_t k, node*& l, node*& r)
     {
-        iterator it = find(t);
-        if (it == end())
+        if (!t)
+        {
+            l = r = nullptr;
             return;
-        do {
-            it = erase(it);
-        } while (*it == t);
+        }
+        node* tl = t->left;
+        node* tr = t->right;
+        if (tl)
+            tl->parent = nullptr;
+        if (tr)
+            tr->parent = nullptr;
+        size_t nl = tl ? tl->n : 0;
+        if (k <= nl)
+        {
+            node* lr;
+            splitNodeAt(tl, k, l, lr);
+            r = joinNodes(lr, t, tr);
+        }
+        else
+        {
+            node* rl;
+            splitNodeAt(tr, k - nl - 1, rl, r);
+            l = joinNodes(tl, t, rl);
+        }
     }
 
-    void clear() noexcept
+    // Unlink the k elements from position i on and return them as a detached subtree.
+    node* cutNodes(size_t i, size_t k)
     {
-        clearNode(root);
-        root->left = nullptr;
-        root->n = 0;
-        root->depth = 1;
+        if (k == 0)
+            return nullptr;
+        node* l;
+        node* rest;
+        node* m;
+        node* r;
+        splitNodeAt(detach(), i, l, rest);
+        splitNodeAt(rest, k, m, r);
+        attach(joinNodes(l, r));
+        return m;
     }
 
-    void swap(tree& t) { std::swap(root, t.root); }
+    // Split t into the elements less than, equal to and greater than key.
+    void splitNode(node* t, const T& key, node*& l, node*& e, node*& r) const
+    {
+        node* ge;
+        splitNode(t, [&](const T& x) { return comp(x, key); }, l, ge);
+        splitNode(ge, [&](const T& x) { return !comp(key, x); }, e, r);
+    }
 
-    size_t size() const { return root->n; }
-    bool empty() const { return root->left == nullptr; }
+    // Take the root of detached subtree t off its children.
+    static void expose(node* t, node*& l, node*& r)
+    {
+        l = t->left;
+        r = t->right;
+        if (l)
+            l->parent = nullptr;
+        if (r)
+            r->parent = nullptr;
+        t->left = t->right = nullptr;
+        t->n = 1;
+        t->depth = 1;
+        t->updateAgg();
+    }
 
-private:
-    void rotateLeft(std::shared_ptr<node> n)
+    // Run the two halves of a set operation, on two threads if the input is large enough.
+    // Nodes dropped by the second half are collected separately and merged afterwards.
+    template <typename F>
+    static void forkSetOp(size_t n, unsigned threads, std::vector<node*>& dropped, F f)
     {
-        std::shared_ptr<node> tmp = n->right->left;
-        if (n == n->parent->left)
-            n->parent->left = n->right;
+        if (threads > 1 && n >= parallelCutoff)
+        {
+            std::vector<node*> dropped2;
+            forkJoin(2, [&](unsigned c) { f(c, c == 0 ? threads / 2 : threads - threads / 2, c == 0 ? dropped : dropped2); });
+            dropped.insert(dropped.end(), dropped2.begin(), dropped2.end());
+        }
         else
+        {
+            f(0, 1, dropped);
+            f(1, 1, dropped);
+        }
+    }
+
+    node* uniteNodes(node* a, node* b, unsigned threads, std::vector<node*>& dropped) const
+    {
+        if (!a)
+            return b;
+        if (!b)
+            return a;
+        size_t n = a->n + b->n;
+        node* al;
+        node* ar;
+        node* bl;
+        node* be;
+        node* br;
+        expose(a, al, ar);
+        splitNode(b, a->data, bl, be, br);
+        if (be)
+            dropped.push_back(be);
+        forkSetOp(n, threads, dropped, [&](unsigned c, unsigned th, std::vector<node*>& d)
+        {
+            if (c == 0)
+                al = uniteNodes(al, bl, th, d);
+            else
+                ar = uniteNodes(ar, br, th, d);
+        });
+        return joinNodes(al, a, ar);
+    }
+
+    // Merge the sorted unlinked nodes [lo, hi) into detached subtree a, placing
+    // them after equal elements of a. Subtrees no node falls into are left as they are.
+    node* mergeNodes(node* a, node** lo, node** hi) const
+    {
+        if (lo == hi)
+            return a;
+        if (!a)
+            return linkNodes(lo, hi - lo, 1);
+        node** mid = std::partition_point(lo, hi, [&](const node* x) { return comp(x->data, a->data); });
+        node* al;
+        node* ar;
+        expose(a, al, ar);
+        al = mergeNodes(al, lo, mid);
+        ar = mergeNodes(ar, mid, hi);
+        return joinNodes(al, a, ar);
+    }
+
+    node* intersectNodes(node* a, node* b, unsigned threads, std::vector<node*>& dropped) const
+    {
+        if (!a || !b)
+        {
+            if (a)
+                dropped.push_back(a);
+            if (b)
+                dropped.push_back(b);
+            return nullptr;
+        }
+        size_t n = a->n + b->n;
+        node* al;
+        node* ar;
+        node* bl;
+        node* be;
+        node* br;
+        expose(a, al, ar);
+        splitNode(b, a->data, bl, be, br);
+        forkSetOp(n, threads, dropped, [&](unsigned c, unsigned th, std::vector<node*>& d)
+        {
+            if (c == 0)
+                al = intersectNodes(al, bl, th, d);
+            else
+                ar = intersectNodes(ar, br, th, d);
+        });
+        if (be)
+        {
+            dropped.push_back(be);
+            return joinNodes(al, a, ar);
+        }
+        dropped.push_back(a);
+        return joinNodes(al, ar);
+    }
+
+    node* subtractNodes(node* a, node* b, unsigned threads, std::vector<node*>& dropped) const
+    {
+        if (!a || !b)
+        {
+            if (b)
+                dropped.push_back(b);
+            return a;
+        }
+        size_t n = a->n + b->n;
+        node* al;
+        node* ae;
+        node* ar;
+        node* bl;
+        node* br;
+        expose(b, bl, br);
+        splitNode(a, b->data, al, ae, ar);
+        dropped.push_back(b);
+        if (ae)
+            dropped.push_back(ae);
+        forkSetOp(n, threads, dropped, [&](unsigned c, unsigned th, std::vector<node*>& d)
+        {
+            if (c == 0)
+                al = subtractNodes(al, bl, th, d);
+            else
+                ar = subtractNodes(ar, br, th, d);
+        });
+        return joinNodes(al, ar);
+    }
+
+    static void rotateLeft(node* n)
+    {
+        node* tmp = n->right->left;
+        if (n->parent && n == n->parent->left)
+            n->parent->left = n->right;
+        else if (n->parent)
             n->parent->right = n->right;
         n->right->parent = n->parent;
         n->right->left = n;
@@ -647,18 +1942,16 @@ private:
         n->updateN();
         n->parent->updateN();
         // update depths
-        do {
-            n->updateDepth();
-            n = n->parent;
-        } while (n);
+        n->updateDepth();
+        n->parent->updateDepth();
     }
 
-    void rotateRight(std::shared_ptr<node> n)
+    static void rotateRight(node* n)
     {
-        std::shared_ptr<node> tmp = n->left->right;
-        if (n == n->parent->left)
+        node* tmp = n->left->right;
+        if (n->parent && n == n->parent->left)
             n->parent->left = n->left;
-        else
+        else if (n->parent)
             n->parent->right = n->left;
         n->left->parent = n->parent;
         n->left->right = n;
@@ -670,46 +1963,294 @@ private:
         n->updateN();
         n->parent->updateN();
         // update depths
-        do {
-            n->updateDepth();
-            n = n->parent;
-        } while (n);
+        n->updateDepth();
+        n->parent->updateDepth();
+    }
+
+    // Build a perfectly balanced subtree from the next n elements of a sorted sequence.
+    template <typename It>
+    node* buildNode(It& it, size_t n)
+    {
+        if (n == 0)
+            return nullptr;
+        node* l = buildNode(it, n / 2);
+        node* nd;
+        node* r;
+        try
+        {
+            nd = newNode(*it);
+        }
+        catch (...)
+        {
+            clearNode(l);
+            throw;
+        }
+        ++it;
+        try
+        {
+            r = buildNode(it, n - n / 2 - 1);
+        }
+        catch (...)
+        {
+            clearNode(l);
+            deleteNode(nd);
+            throw;
+        }
+        nd->left = l;
+        if (l)
+            l->parent = nd;
+        nd->right = r;
+        if (r)
+            r->parent = nd;
+        nd->n = n;
+        nd->updateDepth();
+        nd->updateAgg();
+        return nd;
+    }
+
+    // Allocate the nodes up front, since allocators need not be thread-safe,
+    // then construct and link them in parallel.
+    template <typename RandomIt>
+    node* buildParallel(RandomIt first, size_t n, unsigned threads)
+    {
+        std::vector<node*> nodes(n);
+        size_t i = 0;
+        try
+        {
+            for (; i < n; ++i)
+                nodes[i] = node_traits::allocate(alloc, 1);
+        }
+        catch (...)
+        {
+            while (i--)
+                node_traits::deallocate(alloc, nodes[i], 1);
+            throw;
+        }
+
+        std::vector<size_t> built(threads);
+        try
+        {
+            forkJoin(threads, [&](unsigned c)
+            {
+                for (size_t j = n * c / threads; j < n * (c + 1) / threads; ++j)
+                {
+                    node_traits::construct(alloc, nodes[j], first[j]);
+                    ++built[c];
+                }
+            });
+        }
+        catch (...)
+        {
+            for (unsigned c = 0; c < threads; ++c)
+                for (size_t j = n * c / threads; j < n * c / threads + built[c]; ++j)
+                    node_traits::destroy(alloc, nodes[j]);
+            for (node* nd : nodes)
+                node_traits::deallocate(alloc, nd, 1);
+            throw;
+        }
+        return linkNodes(nodes.data(), n, threads);
     }
 
-    std::shared_ptr<node> deepCopyNode(const std::shared_ptr<node> nd)
+    // Link a sorted array of constructed nodes into a perfectly balanced subtree,
+    // with the same shape as buildNode.
+    static node* linkNodes(node** nodes, size_t n, unsigned threads)
     {
-        std::shared_ptr<node> cp_nd = std::make_shared<node>(nd->data);
+        if (n == 0)
+            return nullptr;
+        node* nd = nodes[n / 2];
+        if (threads > 1 && n >= parallelCutoff)
+        {
+            forkJoin(2, [&](unsigned c)
+            {
+                if (c == 0)
+                    nd->left = linkNodes(nodes, n / 2, threads / 2);
+                else
+                    nd->right = linkNodes(nodes + n / 2 + 1, n - n / 2 - 1, threads - threads / 2);
+            });
+        }
+        else
+        {
+            nd->left = linkNodes(nodes, n / 2, 1);
+            nd->right = linkNodes(nodes + n / 2 + 1, n - n / 2 - 1, 1);
+        }
+        if (nd->left)
+            nd->left->parent = nd;
+        if (nd->right)
+            nd->right->parent = nd;
+        nd->n = n;
+        nd->updateDepth();
+        nd->updateAgg();
+        return nd;
+    }
+
+    // Stable sort: chunks are sorted on their own threads, then merged pairwise in parallel rounds.
+    void sortParallel(std::vector<T>& v, unsigned threads) const
+    {
+        size_t n = v.size();
+        if (threads < 2 || n < parallelCutoff)
+        {
+            std::stable_sort(v.begin(), v.end(), comp);
+            return;
+        }
+        auto bound = [&](size_t c) { return v.begin() + n * std::min<size_t>(c, threads) / threads; };
+        forkJoin(threads, [&](unsigned c) { std::stable_sort(bound(c), bound(c + 1), comp); });
+        for (size_t width = 1; width < threads; width *= 2)
+        {
+            unsigned pairs = static_cast<unsigned>((threads + 2 * width - 1) / (2 * width));
+            forkJoin(pairs, [&](unsigned i)
+            {
+                size_t lo = 2 * width * i;
+                if (lo + width < threads)
+                    std::inplace_merge(bound(lo), bound(lo + width), bound(lo + 2 * width), comp);
+            });
+        }
+    }
+
+    // Run f(0) .. f(tasks - 1) concurrently, f(0) on the calling thread, and
+    // rethrow the first exception once all of them have finished.
+    template <typename F>
+    static void forkJoin(unsigned tasks, F f)
+    {
+        std::vector<std::exception_ptr> errors(tasks);
+        auto run = [&](unsigned i)
+        {
+            try
+            {
+                f(i);
+            }
+            catch (...)
+            {
+                errors[i] = std::current_exception();
+            }
+        };
+        std::vector<std::thread> workers;
+        workers.reserve(tasks);
+        for (unsigned i = 1; i < tasks; ++i)
+        {
+            try
+            {
+                workers.emplace_back(run, i);
+            }
+            catch (const std::system_error&)
+            {
+                run(i);
+            }
+        }
+        run(0);
+        for (std::thread& w : workers)
+            w.join();
+        for (std::exception_ptr& e : errors)
+            if (e)
+                std::rethrow_exception(e);
+    }
+
+    void copyFrom(const tree& t)
+    {
+        if (t.root->left)
+        {
+            root->left = deepCopyNode(t.root->left);
+            root->left->parent = root;
+        }
+        root->n = t.root->n;
+        root->depth = t.root->depth;
+    }
+
+    node* deepCopyNode(const node* nd)
+    {
+        node* cp_nd = newNode(nd->data);
         cp_nd->n = nd->n;
         cp_nd->depth = nd->depth;
-        if (nd->left)
+        try
         {
-            cp_nd->left = deep_copy_node(nd->left);
-            cp_nd->left->parent = cp_nd;
+            if (nd->left)
+            {
+                cp_nd->left = deepCopyNode(nd->left);
+                cp_nd->left->parent = cp_nd;
+            }
+            if (nd->right)
+            {
+                cp_nd->right = deepCopyNode(nd->right);
+                cp_nd->right->parent = cp_nd;
+            }
         }
-        if (nd->right)
+        catch (...)
         {
-            cp_nd->right = deepCopyNode(nd->right);
-            cp_nd->right->parent = cp_nd;
+            clearNode(cp_nd);
+            throw;
         }
+        cp_nd->updateAgg();
         return cp_nd;
     }
 
-    void clearNode(std::shared_ptr<node> nd) noexcept
+    // Free a subtree without recursion: rotate left children up until the
+    // top node has none, then free it and continue with its right child.
+    void clearNode(node* nd) noexcept
     {
-        if (nd->left)
+        while (nd)
         {
-            clearNode(nd->left);
-            nd->left.reset();
+            if (node* l = nd->left)
+            {
+                nd->left = l->right;
+                l->right = nd;
+                nd = l;
+            }
+            else
+            {
+                node* r = nd->right;
+                deleteNode(nd);
+                nd = r;
+            }
         }
-        if (nd->right)
+    }
+
+    // Empty the tree in O(1) when its nodes need no individual freeing: a pool
+    // whose slots hold this tree's nodes and nothing else is dropped wholesale,
+    // and nodes of a monotonic arena are reclaimed with the arena. Returns
+    // false if neither applies.
+    bool dropNodes() noexcept
+    {
+        if constexpr (std::is_trivially_destructible<node>::value)
         {
-            clearNode(nd->right);
-            nd->right.reset();
+            if constexpr (releasable<node_allocator>::value)
+            {
+                // Nodes from the heap leave the slots to whatever else shares the pool.
+                if (alloc.pooled() && alloc.live() == size() + 1)
+                {
+                    alloc.release();
+                    root = newHeader();
+                    return true;
+                }
+            }
+            if constexpr (std::is_same<node_allocator, std::pmr::polymorphic_allocator<node>>::value)
+            {
+                if (dynamic_cast<std::pmr::monotonic_buffer_resource*>(alloc.resource()))
+                {
+                    root->left = nullptr;
+                    root->n = 0;
+                    root->depth = 1;
+                    return true;
+                }
+            }
         }
+        return false;
     }
 
-    std::shared_ptr<node> root;
+    static constexpr size_t parallelCutoff = 1 << 14;   // Smaller ranges are not worth a thread.
+    static constexpr size_t bulkEraseCutoff = 16;       // Shorter ranges are erased node by node.
+
+    node* root;
+    node* tail = nullptr;       // The last node, or null if not known yet.
+    node_allocator alloc;
+    Compare comp;
+    mutable tree_counters counters;
 };
 
-template <typename T>
-void swap(tree<T>& t1, tree<T>& t2) { t1.swap(t2); }
+template <typename T, typename Compare, typename Alloc, typename Augment>
+void swap(tree<T, Compare, Alloc, Augment>& t1, tree<T, Compare, Alloc, Augment>& t2) { t1.swap(t2); }
+
+namespace pmr
+{
+    // tree drawing its nodes from a std::pmr::memory_resource.
+    template <typename T, typename Compare = std::less<>>
+    using tree = ::tree<T, Compare, std::pmr::polymorphic_allocator<T>>;
+}
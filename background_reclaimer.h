@@ -0,0 +1,98 @@
+// Frees containers on a background thread.
+//
+// retire() takes ownership of any movable object, typically a tree whose
+// contents are no longer needed, and returns at once; a worker thread destroys
+// retired objects in the order they arrive. This keeps the cost of freeing a
+// large tree off latency-sensitive threads. The objects' allocators must be
+// usable from the worker thread while the rest of the program runs, which
+// rules out a node_pool shared with trees still in use; tree::clear(r) only
+// hands its nodes over when they come from std::allocator.
+#pragma once
+#include <condition_variable>
+#include <memory>     // unique_ptr
+#include <mutex>
+#include <thread>
+#include <type_traits> // decay_t
+#include <utility>    // forward, swap
+#include <vector>
+
+class background_reclaimer
+{
+    struct garbage
+    {
+        virtual ~garbage() = default;
+    };
+
+    template <typename U>
+    struct holder : garbage
+    {
+        explicit holder(U&& u) : u(std::move(u)) { }
+        U u;
+    };
+
+public:
+    background_reclaimer() : worker([this] { run(); }) { }
+    background_reclaimer(const background_reclaimer&) = delete;
+    background_reclaimer& operator= (const background_reclaimer&) = delete;
+
+    // Destroys whatever is still queued before returning.
+    ~background_reclaimer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    // Hand u over to be destroyed on the worker thread.
+    template <typename U>
+    void retire(U&& u)
+    {
+        std::unique_ptr<garbage> g(new holder<std::decay_t<U>>(std::forward<U>(u)));
+        {
+            std::lock_guard<std::mutex> lock(m);
+            queue.push_back(std::move(g));
+            ++retired;
+        }
+        wake.notify_one();
+    }
+
+    // Wait until everything retired so far has been destroyed.
+    void drain()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        std::size_t target = retired;
+        idle.wait(lock, [&] { return freed >= target; });
+    }
+
+private:
+    void run()
+    {
+        std::vector<std::unique_ptr<garbage>> batch;
+        std::unique_lock<std::mutex> lock(m);
+        while (true)
+        {
+            wake.wait(lock, [&] { return stopping || !queue.empty(); });
+            if (queue.empty())
+                return;
+            std::swap(batch, queue);
+            lock.unlock();
+            std::size_t n = batch.size();
+            batch.clear();
+            lock.lock();
+            freed += n;
+            idle.notify_all();
+        }
+    }
+
+    std::mutex m;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::vector<std::unique_ptr<garbage>> queue;
+    std::size_t retired = 0;
+    std::size_t freed = 0;
+    bool stopping = false;
+    std::thread worker;                // Last, so it starts after the rest is set up.
+};
@@ -0,0 +1,635 @@
+// Benchmarks avl<T> and tree<T> against std::set and std::multiset.
+//
+//   cmake -S . -B build && cmake --build build && build/benchmark
+// or
+//   g++ -std=c++17 -O2 -DNDEBUG -pthread benchmark.cpp -o benchmark
+//
+// Add -march=native (or -mavx2) to let frozen_tree search integer and
+// floating point keys with SIMD compares.
+//   ./benchmark [--sizes 1000,100000,1000000] [--keys int,int64,pod,string]
+//               [--containers avl,tree,set,multiset] [--ops N] [--csv]
+//               [--threads 1,2,4,8,16,32,64]
+//
+// The containers locked_avl and locked_tree (avl<T> and tree<T> behind a
+// mutex), concurrent_avl and sharded (sharded_tree with 64 shards) run only
+// the multi-threaded mixes, once for each thread count. tree<T> also times
+// assign() from shuffled keys at each thread count.
+//
+// Each container, key type and size runs in its own process on POSIX so the
+// reported peak RSS belongs to that case alone.
+#include "avl_tree.h"
+#include "avl_tree_with_iterators.h"
+#include "concurrent_avl_tree.h"
+#include "sharded_tree.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define BENCH_FORK 1
+#elif defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#endif
+
+namespace
+{
+    struct options
+    {
+        std::vector<size_t> sizes = { 1000, 10000, 100000, 1000000 };
+        std::vector<std::string> keys = { "int", "int64", "pod", "string" };
+        std::vector<std::string> containers = { "avl", "tree", "set", "multiset" };
+        size_t ops = 1000000;                   // Cap on operations per lookup/mixed workload.
+        std::vector<size_t> threads = { 1, 2, 4, 8, 16, 32, 64 };
+        bool csv = false;
+    };
+
+    // 64-byte record ordered by its key.
+    struct pod64
+    {
+        std::uint64_t key = 0;
+        char payload[56] = { };
+
+        bool operator< (const pod64& p) const { return key < p.key; }
+        bool operator<= (const pod64& p) const { return key <= p.key; }
+        bool operator== (const pod64& p) const { return key == p.key; }
+        bool operator!= (const pod64& p) const { return key != p.key; }
+    };
+
+    // Keys are built from even numbers so that odd numbers are guaranteed misses.
+    template <typename K> K makeKey(std::uint64_t v);
+    template <> int makeKey<int>(std::uint64_t v) { return static_cast<int>(v); }
+    template <> std::int64_t makeKey<std::int64_t>(std::uint64_t v) { return static_cast<std::int64_t>(v); }
+    template <> pod64 makeKey<pod64>(std::uint64_t v)
+    {
+        pod64 p;
+        p.key = v;
+        std::memset(p.payload, static_cast<int>(v), sizeof(p.payload));
+        return p;
+    }
+    template <> std::string makeKey<std::string>(std::uint64_t v)
+    {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "key-%020llu", static_cast<unsigned long long>(v));
+        return buf;
+    }
+
+    size_t keyBits(int k) { return static_cast<size_t>(k); }
+    size_t keyBits(std::int64_t k) { return static_cast<size_t>(k); }
+    size_t keyBits(const pod64& k) { return static_cast<size_t>(k.key); }
+    size_t keyBits(const std::string& k) { return k.size() + static_cast<unsigned char>(k.back()); }
+
+    double peakRssMb()
+    {
+#if defined(BENCH_FORK)
+        rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+#if defined(__APPLE__)
+        return ru.ru_maxrss / (1024.0 * 1024.0);
+#else
+        return ru.ru_maxrss / 1024.0;
+#endif
+#elif defined(_WIN32)
+        PROCESS_MEMORY_COUNTERS pmc;
+        GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+        return pmc.PeakWorkingSetSize / (1024.0 * 1024.0);
+#else
+        return 0;
+#endif
+    }
+
+    // Uniform interface over the benchmarked containers.
+    template <typename K>
+    struct avlAdapter
+    {
+        static constexpr bool iterable = true;
+        static constexpr bool ranked = false;
+        static constexpr bool batched = false;
+        static constexpr bool freezable = true;
+        static constexpr bool hinted = false;
+        static constexpr bool parallel = false;
+        avl<K> c;
+
+        void insert(const K& k) { c.add(k); }
+        void insertHint(const K&) { }
+        bool find(const K& k) const { return c.search(k); }
+        void erase(const K& k) { c.remove(k); }
+        size_t iterate()
+        {
+            size_t sum = 0;
+            for (const K& k : c)
+                sum += keyBits(k);
+            return sum;
+        }
+        size_t at(size_t) { return 0; }
+        void insertBatch(const K*, const K*) { }
+        size_t findBatch(const K*, const K*) { return 0; }
+        void build(const K*, const K*, unsigned) { }
+        frozen_tree<K> freeze() const { return c.freeze(); }
+    };
+
+    template <typename K>
+    struct treeAdapter
+    {
+        static constexpr bool iterable = true;
+        static constexpr bool ranked = true;
+        static constexpr bool batched = true;
+        static constexpr bool freezable = true;
+        static constexpr bool hinted = true;
+        static constexpr bool parallel = true;
+        tree<K> c;
+        std::vector<typename tree<K>::iterator> found;
+        typename tree<K>::const_iterator hint = c.cend();
+
+        void insert(const K& k) { c.insert(k); }
+        // Hint with the previous insertion, as an ingest loop would.
+        void insertHint(const K& k) { hint = c.insert(hint, k); }
+        bool find(const K& k) const { return c.contains(k); }
+        void erase(const K& k)
+        {
+            auto it = c.find(k);
+            if (it != c.end())
+                c.erase(it);
+        }
+        size_t iterate()
+        {
+            size_t sum = 0;
+            for (auto it = c.cbegin(); it != c.cend(); ++it)
+                sum += keyBits(*it);
+            return sum;
+        }
+        size_t at(size_t i) { return keyBits(c[i]); }
+        void insertBatch(const K* first, const K* last) { c.insert_batch(first, last); }
+        size_t findBatch(const K* first, const K* last)
+        {
+            found.clear();
+            c.find_batch(first, last, std::back_inserter(found));
+            return static_cast<size_t>(std::count_if(found.begin(), found.end(),
+                [&](typename tree<K>::iterator it) { return it != c.end(); }));
+        }
+        void build(const K* first, const K* last, unsigned threads) { c.assign(first, last, threads); }
+        frozen_tree<K> freeze() const { return c.freeze(); }
+    };
+
+    template <typename K, typename Set>
+    struct stdAdapter
+    {
+        static constexpr bool iterable = true;
+        static constexpr bool ranked = false;
+        static constexpr bool batched = false;
+        static constexpr bool freezable = false;
+        static constexpr bool hinted = true;
+        static constexpr bool parallel = false;
+        Set c;
+        typename Set::const_iterator hint = c.cend();
+
+        void insert(const K& k) { c.insert(k); }
+        void insertHint(const K& k) { hint = c.insert(hint, k); }
+        bool find(const K& k) const { return c.find(k) != c.end(); }
+        void erase(const K& k)
+        {
+            auto it = c.find(k);
+            if (it != c.end())
+                c.erase(it);
+        }
+        size_t iterate()
+        {
+            size_t sum = 0;
+            for (const K& k : c)
+                sum += keyBits(k);
+            return sum;
+        }
+        size_t at(size_t) { return 0; }
+        void insertBatch(const K*, const K*) { }
+        size_t findBatch(const K*, const K*) { return 0; }
+        void build(const K*, const K*, unsigned) { }
+        frozen_tree<K> freeze() const { return frozen_tree<K>(); }
+    };
+
+    // Shared sets for the multi-threaded mixes.
+    template <typename K>
+    struct lockedAvlAdapter
+    {
+        avl<K> c;
+        std::mutex m;
+
+        void insert(const K& k) { std::lock_guard<std::mutex> lock(m); c.add(k); }
+        bool find(const K& k) { std::lock_guard<std::mutex> lock(m); return c.search(k); }
+        void erase(const K& k) { std::lock_guard<std::mutex> lock(m); c.remove(k); }
+    };
+
+    template <typename K>
+    struct lockedTreeAdapter
+    {
+        tree<K> c;
+        std::mutex m;
+
+        void insert(const K& k) { std::lock_guard<std::mutex> lock(m); c.insert(k); }
+        bool find(const K& k) { std::lock_guard<std::mutex> lock(m); return c.contains(k); }
+        void erase(const K& k)
+        {
+            std::lock_guard<std::mutex> lock(m);
+            auto it = c.find(k);
+            if (it != c.end())
+                c.erase(it);
+        }
+    };
+
+    template <typename K>
+    struct shardedAdapter
+    {
+        sharded_tree<K> c{ 64 };
+
+        void insert(const K& k) { c.insert(k); }
+        bool find(const K& k) { return c.contains(k); }
+        void erase(const K& k) { c.remove(k); }
+    };
+
+    template <typename K>
+    struct concurrentAvlAdapter
+    {
+        concurrent_avl<K> c;
+
+        void insert(const K& k) { c.add(k); }
+        bool find(const K& k) { return c.search(k); }
+        void erase(const K& k) { c.remove(k); }
+    };
+
+    struct result
+    {
+        double opsPerSec;
+        double p50;
+        double p99;
+    };
+
+    // Run op(i) for i in [0, n), timing a sample of at most ~100K single operations.
+    template <typename Op>
+    result measure(size_t n, Op op)
+    {
+        using clock = std::chrono::steady_clock;
+        size_t stride = std::max<size_t>(1, n / 100000);
+        std::vector<double> lat;
+        lat.reserve(n / stride + 1);
+
+        auto start = clock::now();
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (i % stride == 0)
+            {
+                auto t0 = clock::now();
+                op(i);
+                lat.push_back(std::chrono::duration<double, std::nano>(clock::now() - t0).count());
+            }
+            else
+                op(i);
+        }
+        double secs = std::chrono::duration<double>(clock::now() - start).count();
+
+        result r = { n / secs, 0, 0 };
+        if (!lat.empty())
+        {
+            std::sort(lat.begin(), lat.end());
+            r.p50 = lat[lat.size() / 2];
+            r.p99 = lat[std::min(lat.size() - 1, lat.size() * 99 / 100)];
+        }
+        return r;
+    }
+
+    // Convert a measurement of whole batches into per-element figures.
+    result perElement(result r, size_t batch)
+    {
+        r.opsPerSec *= batch;
+        r.p50 /= batch;
+        r.p99 /= batch;
+        return r;
+    }
+
+    void report(const options& o, const char* container, const char* key, size_t n,
+        const char* workload, const result& r)
+    {
+        if (o.csv)
+            std::printf("%s,%s,%zu,%s,%.0f,%.0f,%.0f,%.1f\n", container, key, n, workload,
+                r.opsPerSec, r.p50, r.p99, peakRssMb());
+        else
+            std::printf("%-14s %-7s %11zu  %-15s %10.3f %9.0f %9.0f %9.1f\n", container, key, n, workload,
+                r.opsPerSec / 1e6, r.p50, r.p99, peakRssMb());
+    }
+
+    volatile size_t sink;
+
+    template <typename Adapter, typename K>
+    void runCase(const options& o, const char* container, const char* key, size_t n)
+    {
+        std::mt19937_64 rng(n);
+        std::vector<std::uint64_t> order(n);
+        for (size_t i = 0; i < n; ++i)
+            order[i] = 2 * i;
+        std::vector<K> sorted(n);
+        for (size_t i = 0; i < n; ++i)
+            sorted[i] = makeKey<K>(order[i]);
+        std::shuffle(order.begin(), order.end(), rng);
+        std::vector<K> shuffled(n);
+        for (size_t i = 0; i < n; ++i)
+            shuffled[i] = makeKey<K>(order[i]);
+        // Nearly sorted: shuffled within consecutive blocks of 8, so each key
+        // lands at most 7 places from its sorted position.
+        std::vector<K> jittered(sorted);
+        for (size_t i = 0; i < n; i += 8)
+            std::shuffle(jittered.begin() + i, jittered.begin() + std::min(i + 8, n), rng);
+        size_t ops = std::min(n, o.ops);
+        std::vector<K> misses(ops);
+        for (size_t i = 0; i < ops; ++i)
+            misses[i] = makeKey<K>(2 * (rng() % n) + 1);
+
+        {
+            Adapter a;
+            report(o, container, key, n, "insert_sorted", measure(n, [&](size_t i) { a.insert(sorted[i]); }));
+        }
+        {
+            Adapter a;
+            report(o, container, key, n, "insert_reverse", measure(n, [&](size_t i) { a.insert(sorted[n - 1 - i]); }));
+        }
+        {
+            Adapter a;
+            report(o, container, key, n, "insert_jitter", measure(n, [&](size_t i) { a.insert(jittered[i]); }));
+        }
+        if (Adapter::hinted)
+        {
+            {
+                Adapter a;
+                report(o, container, key, n, "hint_sorted", measure(n, [&](size_t i) { a.insertHint(sorted[i]); }));
+            }
+            {
+                Adapter a;
+                report(o, container, key, n, "hint_jitter", measure(n, [&](size_t i) { a.insertHint(jittered[i]); }));
+            }
+        }
+
+        if (Adapter::parallel)
+        {
+            // Sort and build from shuffled keys, split across each thread count.
+            for (size_t threads : o.threads)
+            {
+                Adapter b;
+                result r = measure(1, [&](size_t) { b.build(shuffled.data(), shuffled.data() + n, static_cast<unsigned>(threads)); });
+                r.opsPerSec *= n;
+                r.p50 = r.p99 = 0;
+                char name[32];
+                std::snprintf(name, sizeof(name), "build_t%zu", threads);
+                report(o, container, key, n, name, r);
+            }
+        }
+
+        Adapter a;
+        report(o, container, key, n, "insert_random", measure(n, [&](size_t i) { a.insert(shuffled[i]); }));
+
+        size_t hits = 0;
+        report(o, container, key, n, "find_hit", measure(ops, [&](size_t i) { hits += a.find(shuffled[(i * 7919) % n]); }));
+        report(o, container, key, n, "find_miss", measure(ops, [&](size_t i) { hits += a.find(misses[i]); }));
+        if (Adapter::freezable)
+        {
+            frozen_tree<K> f = a.freeze();
+            report(o, container, key, n, "frozen_find_hit", measure(ops, [&](size_t i) { hits += f.contains(shuffled[(i * 7919) % n]); }));
+            report(o, container, key, n, "frozen_find_miss", measure(ops, [&](size_t i) { hits += f.contains(misses[i]); }));
+        }
+        if (Adapter::batched)
+        {
+            // Batches of 1000 shuffled keys, into a fresh tree and against the full one.
+            size_t batch = std::min<size_t>(n, 1000);
+            Adapter b;
+            report(o, container, key, n, "insert_batch", perElement(measure(n / batch, [&](size_t i)
+            {
+                b.insertBatch(&shuffled[i * batch], &shuffled[i * batch] + batch);
+            }), batch));
+            report(o, container, key, n, "find_batch", perElement(measure(ops / batch, [&](size_t i)
+            {
+                hits += a.findBatch(&shuffled[i * batch], &shuffled[i * batch] + batch);
+            }), batch));
+        }
+        if (Adapter::iterable)
+        {
+            result r = measure(1, [&](size_t) { sink = a.iterate(); });
+            r.opsPerSec *= n;
+            r.p50 = r.p99 = 0;
+            report(o, container, key, n, "iterate", r);
+        }
+        if (Adapter::ranked)
+            report(o, container, key, n, "at", measure(ops, [&](size_t) { sink = a.at(rng() % n); }));
+
+        // Mixed workloads keep the size steady: writes alternate between
+        // erasing a present key and inserting it back.
+        for (unsigned readPct : { 90u, 50u })
+        {
+            std::uniform_int_distribution<unsigned> pct(0, 99);
+            size_t w = 0;
+            char name[32];
+            std::snprintf(name, sizeof(name), "mixed_%u_%u", readPct, 100 - readPct);
+            report(o, container, key, n, name, measure(ops, [&](size_t i)
+            {
+                if (pct(rng) < readPct)
+                    hits += a.find(shuffled[(i * 7919) % n]);
+                else
+                {
+                    const K& k = shuffled[(w / 2) % n];
+                    if (w++ % 2 == 0)
+                        a.erase(k);
+                    else
+                        a.insert(k);
+                }
+            }));
+        }
+
+        report(o, container, key, n, "erase", measure(n, [&](size_t i) { a.erase(shuffled[i]); }));
+        sink = hits;
+    }
+
+    // Each thread count shares one pre-filled set between its threads. Writers
+    // erase and re-insert keys from their own slice so the size stays steady.
+    template <typename Adapter, typename K>
+    void runThreaded(const options& o, const char* container, const char* key, size_t n)
+    {
+        std::mt19937_64 rng(n);
+        std::vector<K> shuffled(n);
+        for (size_t i = 0; i < n; ++i)
+            shuffled[i] = makeKey<K>(2 * i);
+        std::shuffle(shuffled.begin(), shuffled.end(), rng);
+        size_t ops = std::min(n, o.ops);
+
+        for (unsigned readPct : { 90u, 50u, 0u })
+            for (size_t threads : o.threads)
+            {
+                Adapter a;
+                for (const K& k : shuffled)
+                    a.insert(k);
+
+                std::atomic<bool> go{ false };
+                std::atomic<size_t> hits{ 0 };
+                std::vector<std::thread> pool;
+                for (size_t t = 0; t < threads; ++t)
+                    pool.emplace_back([&, t]
+                    {
+                        std::mt19937_64 r(t + 1);
+                        std::uniform_int_distribution<unsigned> pct(0, 99);
+                        size_t h = 0, w = 0;
+                        while (!go.load(std::memory_order_acquire))
+                            std::this_thread::yield();
+                        for (size_t i = t; i < ops; i += threads)
+                        {
+                            if (pct(r) < readPct)
+                                h += a.find(shuffled[r() % n]);
+                            else
+                            {
+                                const K& k = shuffled[(t + threads * (w / 2)) % n];
+                                if (w++ % 2 == 0)
+                                    a.erase(k);
+                                else
+                                    a.insert(k);
+                            }
+                        }
+                        hits += h;
+                    });
+
+                auto start = std::chrono::steady_clock::now();
+                go.store(true, std::memory_order_release);
+                for (std::thread& th : pool)
+                    th.join();
+                double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+                char name[32];
+                std::snprintf(name, sizeof(name), "mt_%u_%u_t%zu", readPct, 100 - readPct, threads);
+                report(o, container, key, n, name, { ops / secs, 0, 0 });
+                sink = hits;
+            }
+    }
+
+    template <typename K>
+    void runContainer(const options& o, const std::string& container, const char* key, size_t n)
+    {
+        if (container == "avl")
+            runCase<avlAdapter<K>, K>(o, "avl", key, n);
+        else if (container == "tree")
+            runCase<treeAdapter<K>, K>(o, "tree", key, n);
+        else if (container == "set")
+            runCase<stdAdapter<K, std::set<K>>, K>(o, "set", key, n);
+        else if (container == "multiset")
+            runCase<stdAdapter<K, std::multiset<K>>, K>(o, "multiset", key, n);
+        else if (container == "locked_avl")
+            runThreaded<lockedAvlAdapter<K>, K>(o, "locked_avl", key, n);
+        else if (container == "locked_tree")
+            runThreaded<lockedTreeAdapter<K>, K>(o, "locked_tree", key, n);
+        else if (container == "concurrent_avl")
+            runThreaded<concurrentAvlAdapter<K>, K>(o, "concurrent_avl", key, n);
+        else if (container == "sharded")
+            runThreaded<shardedAdapter<K>, K>(o, "sharded", key, n);
+    }
+
+    void runKey(const options& o, const std::string& container, const std::string& key, size_t n)
+    {
+        if (key == "int")
+            runContainer<int>(o, container, "int", n);
+        else if (key == "int64")
+            runContainer<std::int64_t>(o, container, "int64", n);
+        else if (key == "pod")
+            runContainer<pod64>(o, container, "pod64", n);
+        else if (key == "string")
+            runContainer<std::string>(o, container, "string", n);
+    }
+
+    template <typename T>
+    std::vector<T> splitList(const char* s, T (*parse)(const std::string&))
+    {
+        std::vector<T> out;
+        std::string item;
+        for (const char* p = s; ; ++p)
+        {
+            if (*p == ',' || *p == '\0')
+            {
+                if (!item.empty())
+                    out.push_back(parse(item));
+                item.clear();
+                if (*p == '\0')
+                    break;
+            }
+            else
+                item += *p;
+        }
+        return out;
+    }
+
+    size_t parseSize(const std::string& s) { return static_cast<size_t>(std::strtoull(s.c_str(), nullptr, 10)); }
+    std::string parseName(const std::string& s) { return s; }
+}
+
+int main(int argc, char** argv)
+{
+    options o;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--csv")
+            o.csv = true;
+        else if (i + 1 < argc && arg == "--sizes")
+            o.sizes = splitList(argv[++i], parseSize);
+        else if (i + 1 < argc && arg == "--keys")
+            o.keys = splitList(argv[++i], parseName);
+        else if (i + 1 < argc && arg == "--containers")
+            o.containers = splitList(argv[++i], parseName);
+        else if (i + 1 < argc && arg == "--ops")
+            o.ops = parseSize(argv[++i]);
+        else if (i + 1 < argc && arg == "--threads")
+            o.threads = splitList(argv[++i], parseSize);
+        else
+        {
+            std::fprintf(stderr, "usage: %s [--sizes a,b,..] [--keys int,int64,pod,string] "
+                "[--containers avl,tree,set,multiset,locked_avl,locked_tree,concurrent_avl,sharded] "
+                "[--ops N] [--csv] "
+                "[--threads a,b,..]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (o.csv)
+        std::printf("container,key,n,workload,ops_per_sec,p50_ns,p99_ns,peak_rss_mb\n");
+    else
+        std::printf("%-14s %-7s %11s  %-15s %10s %9s %9s %9s\n", "container", "key", "n", "workload",
+            "Mops/s", "p50 ns", "p99 ns", "RSS MB");
+
+    for (const std::string& key : o.keys)
+        for (size_t n : o.sizes)
+            for (const std::string& container : o.containers)
+            {
+                std::fflush(stdout);
+#if defined(BENCH_FORK)
+                pid_t pid = fork();
+                if (pid == 0)
+                {
+                    runKey(o, container, key, n);
+                    std::fflush(stdout);
+                    _exit(0);
+                }
+                if (pid > 0)
+                {
+                    int status;
+                    waitpid(pid, &status, 0);
+                    continue;
+                }
+#endif
+                runKey(o, container, key, n);
+            }
+    return 0;
+}
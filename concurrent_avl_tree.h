@@ -0,0 +1,708 @@
+// Concurrent AVL set with optimistic concurrency control, after Bronson, Casper,
+// Chafi and Olukotun, "A Practical Concurrent Binary Search Tree" (PPoPP 2010).
+//
+// Any number of threads may add, remove and search at once. Searches take no
+// locks: each step down the tree reads a child link and then checks that the
+// parent's version has not changed, so a rotation that moved the target out of
+// the subtree being searched makes the step retry from the parent rather than
+// from the root. Writers lock only the node they link a child under, and
+// rebalancing locks a parent and the few nodes below it that it rotates.
+//
+// Removing a node with two children leaves it in place as a routing node,
+// which is unlinked later once it has at most one child. Unlinked nodes may
+// still be read by operations that were in flight, so they are freed only
+// after every operation that started before the unlinking has finished.
+#pragma once
+#include <algorithm>  // max
+#include <atomic>
+#include <cstddef>    // size_t
+#include <cstdint>    // uint64_t
+#include <functional> // less
+#include <mutex>      // lock_guard, retire list
+#include <thread>     // yield
+#include <vector>     // retired nodes
+
+template <typename T, typename Compare = std::less<>>
+class concurrent_avl
+{
+private:
+    // Test-and-test-and-set lock; node locks are held for a few stores.
+    class spin_lock
+    {
+    public:
+        void lock()
+        {
+            while (flag.exchange(true, std::memory_order_acquire))
+                while (flag.load(std::memory_order_relaxed))
+                    std::this_thread::yield();
+        }
+        void unlock() { flag.store(false, std::memory_order_release); }
+
+    private:
+        std::atomic<bool> flag{ false };
+    };
+
+    struct avlNode
+    {
+        avlNode(const T& k, avlNode* p) : key(k), parent(p) { }
+
+        avlNode* child(bool right) const { return right ? this->right.load() : left.load(); }
+        void setChild(bool right, avlNode* c) { (right ? this->right : left).store(c); }
+
+        const T key;
+        std::atomic<int> height{ 1 };
+        std::atomic<bool> present{ true };       // False for a routing node.
+        std::atomic<avlNode*> parent;
+        std::atomic<avlNode*> left{ nullptr };
+        std::atomic<avlNode*> right{ nullptr };
+        std::atomic<std::uint64_t> version{ 0 }; // Bumped each time the subtree loses keys.
+        spin_lock lock;
+    };
+
+    // Version bits: unlinked is a value of its own, shrinking marks a rotation
+    // in progress, and the rest counts finished rotations.
+    static constexpr std::uint64_t unlinked = 1;
+    static constexpr std::uint64_t shrinking = 2;
+
+    enum outcome { no, yes, retry };
+
+    // nodeCondition results other than a new height.
+    static constexpr int unlinkRequired = -1;
+    static constexpr int rebalanceRequired = -2;
+    static constexpr int nothingRequired = -3;
+
+    // Per-thread-group counters on their own cache lines: operations in flight
+    // in each of the two epoch parities, and the change in size.
+    struct alignas(64) stripe
+    {
+        std::atomic<std::size_t> active[2] = { };
+        std::atomic<std::ptrdiff_t> count{ 0 };
+    };
+    static constexpr unsigned stripes = 64;
+    static constexpr std::size_t reclaimBatch = 1024; // Retired nodes that trigger a reclaim.
+
+    avlNode holder;                              // Its right child is the root.
+    mutable stripe counters[stripes];
+    std::atomic<unsigned> epoch{ 0 };
+    std::mutex retireLock;
+    std::vector<avlNode*> retired;               // Unlinked, waiting for older operations to finish.
+    std::atomic<std::size_t> retiredCount{ 0 };
+    std::mutex reclaimLock;
+    Compare comp;
+
+public:
+    concurrent_avl() : holder(T(), nullptr) { }
+    explicit concurrent_avl(const Compare& c) : holder(T(), nullptr), comp(c) { }
+    concurrent_avl(const concurrent_avl&) = delete;
+    concurrent_avl& operator= (const concurrent_avl&) = delete;
+
+    ~concurrent_avl()
+    {
+        std::vector<avlNode*> stack;
+        if (avlNode* root = holder.right.load())
+            stack.push_back(root);
+        while (!stack.empty())
+        {
+            avlNode* n = stack.back();
+            stack.pop_back();
+            if (n->left.load())
+                stack.push_back(n->left.load());
+            if (n->right.load())
+                stack.push_back(n->right.load());
+            delete n;
+        }
+        for (avlNode* n : retired)
+            delete n;
+    }
+
+    bool search(const T& data) const
+    {
+        unsigned parity = enter();
+        outcome o;
+        while ((o = attemptGet(data, const_cast<avlNode*>(&holder), true, 0)) == retry)
+            ;
+        leave(parity);
+        return o == yes;
+    }
+
+    // Returns false if an equivalent element is already present.
+    bool add(const T& data)
+    {
+        unsigned parity = enter();
+        outcome o;
+        while ((o = attemptAdd(data, &holder, true, 0)) == retry)
+            ;
+        if (o == yes)
+            counters[stripeOf()].count.fetch_add(1, std::memory_order_relaxed);
+        leave(parity);
+        reclaim();
+        return o == yes;
+    }
+
+    // Returns false if no equivalent element was present.
+    bool remove(const T& data)
+    {
+        unsigned parity = enter();
+        outcome o;
+        while ((o = attemptRemove(data, &holder, true, 0)) == retry)
+            ;
+        if (o == yes)
+            counters[stripeOf()].count.fetch_sub(1, std::memory_order_relaxed);
+        leave(parity);
+        reclaim();
+        return o == yes;
+    }
+
+    // Exact when no update is in flight.
+    std::size_t size() const
+    {
+        std::ptrdiff_t n = 0;
+        for (const stripe& s : counters)
+            n += s.count.load(std::memory_order_relaxed);
+        return n > 0 ? static_cast<std::size_t>(n) : 0;
+    }
+
+    // Whether the links, order, heights and balance are all consistent and no
+    // removable routing node is left. Only meaningful when no update is in flight.
+    bool valid() const
+    {
+        int h;
+        return validSubtree(holder.right.load(), &holder, nullptr, nullptr, h);
+    }
+
+private:
+    static int heightOf(const avlNode* n) { return n ? n->height.load() : 0; }
+    static bool canUnlink(const avlNode* n) { return !n->left.load() || !n->right.load(); }
+    static std::uint64_t beginChange(std::uint64_t v) { return v | shrinking; }
+    static std::uint64_t endChange(std::uint64_t v) { return (v | unlinked | shrinking) + 1; }
+
+    bool validSubtree(const avlNode* n, const avlNode* parent, const T* lo, const T* hi, int& h) const
+    {
+        h = 0;
+        if (!n)
+            return true;
+        int hl, hr;
+        if (n->parent.load() != parent || n->version.load() == unlinked ||
+            (lo && !comp(*lo, n->key)) || (hi && !comp(n->key, *hi)) ||
+            !validSubtree(n->left.load(), n, lo, &n->key, hl) ||
+            !validSubtree(n->right.load(), n, &n->key, hi, hr))
+            return false;
+        h = 1 + std::max(hl, hr);
+        bool routable = n->present.load() || (hl && hr);
+        return routable && n->height.load() == h && hl - hr >= -1 && hl - hr <= 1;
+    }
+
+    // A rotation holds the node's lock for as long as it is shrinking.
+    static void waitUntilNotChanging(avlNode* n)
+    {
+        std::uint64_t v = n->version.load();
+        if (v & shrinking)
+        {
+            for (int i = 0; i < 100 && n->version.load() == v; ++i)
+                ;
+            std::lock_guard<spin_lock> wait(n->lock);
+        }
+    }
+
+    // Search the dir child of n, where n had version nodeV when the caller
+    // validated the link to it.
+    outcome attemptGet(const T& k, avlNode* n, bool dir, std::uint64_t nodeV) const
+    {
+        while (true)
+        {
+            avlNode* child = n->child(dir);
+            if (n->version.load() != nodeV)
+                return retry;
+            if (!child)
+                return no;
+            bool goLeft = comp(k, child->key);
+            bool goRight = !goLeft && comp(child->key, k);
+            if (!goLeft && !goRight)
+                return child->present.load() ? yes : no;
+            std::uint64_t childV = child->version.load();
+            if (childV & shrinking)
+                waitUntilNotChanging(child);
+            else if (childV != unlinked && child == n->child(dir))
+            {
+                if (n->version.load() != nodeV)
+                    return retry;
+                outcome o = attemptGet(k, child, goRight, childV);
+                if (o != retry)
+                    return o;
+            }
+        }
+    }
+
+    outcome attemptAdd(const T& k, avlNode* n, bool dir, std::uint64_t nodeV)
+    {
+        outcome o = retry;
+        do
+        {
+            avlNode* child = n->child(dir);
+            if (n->version.load() != nodeV)
+                return retry;
+            if (!child)
+                o = attemptInsert(k, n, dir, nodeV);
+            else
+            {
+                bool goLeft = comp(k, child->key);
+                bool goRight = !goLeft && comp(child->key, k);
+                if (!goLeft && !goRight)
+                    o = attemptRevive(child);
+                else
+                {
+                    std::uint64_t childV = child->version.load();
+                    if (childV & shrinking)
+                        waitUntilNotChanging(child);
+                    else if (childV != unlinked && child == n->child(dir))
+                    {
+                        if (n->version.load() != nodeV)
+                            return retry;
+                        o = attemptAdd(k, child, goRight, childV);
+                    }
+                }
+            }
+        } while (o == retry);
+        return o;
+    }
+
+    outcome attemptInsert(const T& k, avlNode* n, bool dir, std::uint64_t nodeV)
+    {
+        {
+            std::lock_guard<spin_lock> guard(n->lock);
+            if (n->version.load() != nodeV || n->child(dir))
+                return retry;
+            n->setChild(dir, new avlNode(k, n));
+        }
+        fixHeightAndRebalance(n);
+        return yes;
+    }
+
+    // Turn a routing node back into an element.
+    outcome attemptRevive(avlNode* n)
+    {
+        std::lock_guard<spin_lock> guard(n->lock);
+        if (n->version.load() == unlinked)
+            return retry;
+        if (n->present.load())
+            return no;
+        n->present.store(true);
+        return yes;
+    }
+
+    outcome attemptRemove(const T& k, avlNode* n, bool dir, std::uint64_t nodeV)
+    {
+        outcome o = retry;
+        do
+        {
+            avlNode* child = n->child(dir);
+            if (n->version.load() != nodeV)
+                return retry;
+            if (!child)
+                return no;
+            bool goLeft = comp(k, child->key);
+            bool goRight = !goLeft && comp(child->key, k);
+            if (!goLeft && !goRight)
+                o = attemptRemoveNode(n, child);
+            else
+            {
+                std::uint64_t childV = child->version.load();
+                if (childV & shrinking)
+                    waitUntilNotChanging(child);
+                else if (childV != unlinked && child == n->child(dir))
+                {
+                    if (n->version.load() != nodeV)
+                        return retry;
+                    o = attemptRemove(k, child, goRight, childV);
+                }
+            }
+        } while (o == retry);
+        return o;
+    }
+
+    // Unlink n if it has at most one child, otherwise leave it as a routing node.
+    outcome attemptRemoveNode(avlNode* parent, avlNode* n)
+    {
+        if (!n->present.load())
+            return no;
+        if (!canUnlink(n))
+        {
+            std::lock_guard<spin_lock> guard(n->lock);
+            if (n->version.load() == unlinked || canUnlink(n))
+                return retry;
+            if (!n->present.load())
+                return no;
+            n->present.store(false);
+            return yes;
+        }
+        {
+            std::lock_guard<spin_lock> parentGuard(parent->lock);
+            if (parent->version.load() == unlinked || n->parent.load() != parent || n->version.load() == unlinked)
+                return retry;
+            std::lock_guard<spin_lock> guard(n->lock);
+            if (!n->present.load())
+                return no;
+            if (!canUnlink(n))
+                return retry;
+            avlNode* c = n->left.load() ? n->left.load() : n->right.load();
+            if (parent->left.load() == n)
+                parent->left.store(c);
+            else
+                parent->right.store(c);
+            if (c)
+                c->parent.store(parent);
+            n->version.store(unlinked);
+            n->present.store(false);
+        }
+        retire(n);
+        fixHeightAndRebalance(parent);
+        return yes;
+    }
+
+    int nodeCondition(avlNode* n) const
+    {
+        avlNode* l = n->left.load();
+        avlNode* r = n->right.load();
+        if ((!l || !r) && !n->present.load())
+            return unlinkRequired;
+        int h = n->height.load();
+        int hl = heightOf(l);
+        int hr = heightOf(r);
+        int repl = 1 + std::max(hl, hr);
+        int bal = hl - hr;
+        if (bal < -1 || bal > 1)
+            return rebalanceRequired;
+        return h != repl ? repl : nothingRequired;
+    }
+
+    // Walk up from n repairing heights, balance and routing nodes left behind.
+    void fixHeightAndRebalance(avlNode* n)
+    {
+        // Keep checking upward past sound nodes: a rotation that stops at a
+        // damaged lower node leaves its parent's height stale too. A node is
+        // only left behind once it is seen sound after its last repair, so of
+        // two threads changing heights on the same path, at least one sees
+        // the other's store and the heights settle once updates stop.
+        while (n && n->parent.load())
+        {
+            int c = nodeCondition(n);
+            if (c == nothingRequired || n->version.load() == unlinked)
+                n = n->parent.load();
+            else if (c != unlinkRequired && c != rebalanceRequired)
+            {
+                std::lock_guard<spin_lock> guard(n->lock);
+                avlNode* next = fixHeight_nl(n);
+                if (next)
+                    n = next;
+            }
+            else
+            {
+                avlNode* parent = n->parent.load();
+                std::lock_guard<spin_lock> parentGuard(parent->lock);
+                if (parent->version.load() != unlinked && n->parent.load() == parent)
+                {
+                    std::lock_guard<spin_lock> guard(n->lock);
+                    avlNode* next = rebalance_nl(parent, n);
+                    n = next ? next : parent;
+                }
+            }
+        }
+    }
+
+    // The _nl helpers expect the caller to hold the locks of the nodes they change.
+    // Each returns the next node to check, the lowest one it changed if any, or
+    // null.
+
+    avlNode* fixHeight_nl(avlNode* n)
+    {
+        int c = nodeCondition(n);
+        switch (c)
+        {
+        case rebalanceRequired:
+        case unlinkRequired:
+            return n;
+        case nothingRequired:
+            return nullptr;
+        default:
+            n->height.store(c);
+            return n;
+        }
+    }
+
+    avlNode* rebalance_nl(avlNode* parent, avlNode* n)
+    {
+        avlNode* l = n->left.load();
+        avlNode* r = n->right.load();
+        if ((!l || !r) && !n->present.load())
+            return attemptUnlink_nl(parent, n) ? fixHeight_nl(parent) : n;
+        int h = n->height.load();
+        int hl = heightOf(l);
+        int hr = heightOf(r);
+        int repl = 1 + std::max(hl, hr);
+        int bal = hl - hr;
+        if (bal > 1)
+            return rebalanceToRight_nl(parent, n, l, hr);
+        if (bal < -1)
+            return rebalanceToLeft_nl(parent, n, r, hl);
+        if (repl != h)
+        {
+            n->height.store(repl);
+            return n;
+        }
+        return nullptr;
+    }
+
+    // n's left subtree is too tall: rotate right, first rotating l left if its
+    // right side is the taller one.
+    avlNode* rebalanceToRight_nl(avlNode* parent, avlNode* n, avlNode* l, int hr0)
+    {
+        std::lock_guard<spin_lock> guard(l->lock);
+        int hl = l->height.load();
+        if (hl - hr0 <= 1)
+            return n;
+        avlNode* lr = l->right.load();
+        int hll0 = heightOf(l->left.load());
+        int hlr0 = heightOf(lr);
+        if (hll0 >= hlr0)
+            return rotateRight_nl(parent, n, l, hr0, hll0, lr, hlr0);
+        {
+            std::lock_guard<spin_lock> lrGuard(lr->lock);
+            int hlr = lr->height.load();
+            if (hll0 >= hlr)
+                return rotateRight_nl(parent, n, l, hr0, hll0, lr, hlr);
+            // A double rotation is only done if it leaves l balanced and not a
+            // removable routing node; otherwise l is fixed on its own first.
+            int hlrl = heightOf(lr->left.load());
+            int b = hll0 - hlrl;
+            if (b >= -1 && b <= 1)
+            {
+                if (!((hll0 == 0 || hlrl == 0) && !l->present.load()))
+                    return rotateRightOverLeft_nl(parent, n, l, hr0, hll0, lr, hlrl);
+                // l would be left a routing node with one child: rotate l on its
+                // own, which returns l to be unlinked before n is seen to again.
+                return rotateLeft_nl(n, l, hll0, lr, lr->left.load(), hlrl, heightOf(lr->right.load()));
+            }
+        }
+        return rebalanceToLeft_nl(n, l, lr, hll0);
+    }
+
+    avlNode* rebalanceToLeft_nl(avlNode* parent, avlNode* n, avlNode* r, int hl0)
+    {
+        std::lock_guard<spin_lock> guard(r->lock);
+        int hr = r->height.load();
+        if (hl0 - hr >= -1)
+            return n;
+        avlNode* rl = r->left.load();
+        int hrl0 = heightOf(rl);
+        int hrr0 = heightOf(r->right.load());
+        if (hrr0 >= hrl0)
+            return rotateLeft_nl(parent, n, hl0, r, rl, hrl0, hrr0);
+        {
+            std::lock_guard<spin_lock> rlGuard(rl->lock);
+            int hrl = rl->height.load();
+            if (hrr0 >= hrl)
+                return rotateLeft_nl(parent, n, hl0, r, rl, hrl, hrr0);
+            int hrlr = heightOf(rl->right.load());
+            int b = hrr0 - hrlr;
+            if (b >= -1 && b <= 1)
+            {
+                if (!((hrr0 == 0 || hrlr == 0) && !r->present.load()))
+                    return rotateLeftOverRight_nl(parent, n, hl0, r, rl, hrr0, hrlr);
+                return rotateRight_nl(n, r, rl, hrr0, heightOf(rl->left.load()), rl->right.load(), hrlr);
+            }
+        }
+        return rebalanceToRight_nl(n, r, rl, hrr0);
+    }
+
+    void replaceChild(avlNode* parent, avlNode* from, avlNode* to)
+    {
+        if (parent->left.load() == from)
+            parent->left.store(to);
+        else
+            parent->right.store(to);
+        to->parent.store(parent);
+    }
+
+    avlNode* rotateRight_nl(avlNode* parent, avlNode* n, avlNode* l, int hr, int hll, avlNode* lr, int hlr)
+    {
+        std::uint64_t v = n->version.load();
+        n->version.store(beginChange(v));
+        n->left.store(lr);
+        if (lr)
+            lr->parent.store(n);
+        l->right.store(n);
+        n->parent.store(l);
+        replaceChild(parent, n, l);
+        int hn = 1 + std::max(hlr, hr);
+        n->height.store(hn);
+        l->height.store(1 + std::max(hll, hn));
+        n->version.store(endChange(v));
+
+        // The heights below n may have changed since they were read; check n
+        // again now, then l and the nodes above it.
+        return nodeCondition(n) != nothingRequired ? n : l;
+    }
+
+    avlNode* rotateLeft_nl(avlNode* parent, avlNode* n, int hl, avlNode* r, avlNode* rl, int hrl, int hrr)
+    {
+        std::uint64_t v = n->version.load();
+        n->version.store(beginChange(v));
+        n->right.store(rl);
+        if (rl)
+            rl->parent.store(n);
+        r->left.store(n);
+        n->parent.store(r);
+        replaceChild(parent, n, r);
+        int hn = 1 + std::max(hl, hrl);
+        n->height.store(hn);
+        r->height.store(1 + std::max(hn, hrr));
+        n->version.store(endChange(v));
+
+        return nodeCondition(n) != nothingRequired ? n : r;
+    }
+
+    avlNode* rotateRightOverLeft_nl(avlNode* parent, avlNode* n, avlNode* l, int hr, int hll, avlNode* lr, int hlrl)
+    {
+        std::uint64_t v = n->version.load();
+        std::uint64_t lv = l->version.load();
+        avlNode* lrl = lr->left.load();
+        avlNode* lrr = lr->right.load();
+        int hlrr = heightOf(lrr);
+        n->version.store(beginChange(v));
+        l->version.store(beginChange(lv));
+        n->left.store(lrr);
+        if (lrr)
+            lrr->parent.store(n);
+        l->right.store(lrl);
+        if (lrl)
+            lrl->parent.store(l);
+        lr->left.store(l);
+        l->parent.store(lr);
+        lr->right.store(n);
+        n->parent.store(lr);
+        replaceChild(parent, n, lr);
+        int hn = 1 + std::max(hlrr, hr);
+        n->height.store(hn);
+        int hl = 1 + std::max(hll, hlrl);
+        l->height.store(hl);
+        lr->height.store(1 + std::max(hl, hn));
+        n->version.store(endChange(v));
+        l->version.store(endChange(lv));
+
+        if (nodeCondition(n) != nothingRequired)
+            return n;
+        return nodeCondition(l) != nothingRequired ? l : lr;
+    }
+
+    avlNode* rotateLeftOverRight_nl(avlNode* parent, avlNode* n, int hl, avlNode* r, avlNode* rl, int hrr, int hrlr)
+    {
+        std::uint64_t v = n->version.load();
+        std::uint64_t rv = r->version.load();
+        avlNode* rll = rl->left.load();
+        avlNode* rlr = rl->right.load();
+        int hrll = heightOf(rll);
+        n->version.store(beginChange(v));
+        r->version.store(beginChange(rv));
+        n->right.store(rll);
+        if (rll)
+            rll->parent.store(n);
+        r->left.store(rlr);
+        if (rlr)
+            rlr->parent.store(r);
+        rl->right.store(r);
+        r->parent.store(rl);
+        rl->left.store(n);
+        n->parent.store(rl);
+        replaceChild(parent, n, rl);
+        int hn = 1 + std::max(hl, hrll);
+        n->height.store(hn);
+        int hr = 1 + std::max(hrlr, hrr);
+        r->height.store(hr);
+        rl->height.store(1 + std::max(hn, hr));
+        n->version.store(endChange(v));
+        r->version.store(endChange(rv));
+
+        if (nodeCondition(n) != nothingRequired)
+            return n;
+        return nodeCondition(r) != nothingRequired ? r : rl;
+    }
+
+    // Splice out routing node n, if it is still parent's child with at most one child.
+    bool attemptUnlink_nl(avlNode* parent, avlNode* n)
+    {
+        avlNode* pl = parent->left.load();
+        avlNode* pr = parent->right.load();
+        if (pl != n && pr != n)
+            return false;
+        avlNode* l = n->left.load();
+        avlNode* r = n->right.load();
+        if (l && r)
+            return false;
+        avlNode* splice = l ? l : r;
+        if (pl == n)
+            parent->left.store(splice);
+        else
+            parent->right.store(splice);
+        if (splice)
+            splice->parent.store(parent);
+        n->version.store(unlinked);
+        retire(n);
+        return true;
+    }
+
+    // Operations register in the stripe of their thread under the current
+    // epoch's parity. A reclaim flips the epoch and then waits for the old
+    // parity to drain, after which nothing can still see the nodes retired
+    // before the flip.
+    static unsigned stripeOf()
+    {
+        static std::atomic<unsigned> next{ 0 };
+        thread_local unsigned s = next.fetch_add(1, std::memory_order_relaxed) % stripes;
+        return s;
+    }
+
+    unsigned enter() const
+    {
+        stripe& s = counters[stripeOf()];
+        while (true)
+        {
+            unsigned e = epoch.load();
+            s.active[e & 1].fetch_add(1);
+            if (epoch.load() == e)
+                return e & 1;
+            s.active[e & 1].fetch_sub(1);
+        }
+    }
+
+    void leave(unsigned parity) const { counters[stripeOf()].active[parity].fetch_sub(1); }
+
+    void retire(avlNode* n)
+    {
+        std::lock_guard<std::mutex> guard(retireLock);
+        retired.push_back(n);
+        retiredCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Free a batch of retired nodes, unless another thread is already at it.
+    // Called outside of any operation, so the wait cannot be on ourselves.
+    void reclaim()
+    {
+        if (retiredCount.load(std::memory_order_relaxed) < reclaimBatch)
+            return;
+        std::unique_lock<std::mutex> reclaiming(reclaimLock, std::try_to_lock);
+        if (!reclaiming)
+            return;
+        std::vector<avlNode*> limbo;
+        {
+            std::lock_guard<std::mutex> guard(retireLock);
+            limbo.swap(retired);
+            retiredCount.store(0, std::memory_order_relaxed);
+        }
+        unsigned old = epoch.fetch_add(1) & 1;
+        for (stripe& s : counters)
+            while (s.active[old].load() != 0)
+                std::this_thread::yield();
+        for (avlNode* n : limbo)
+            delete n;
+    }
+};
@@ -0,0 +1,426 @@
+// Immutable, read-optimized snapshot of a tree<T> or avl<T>.
+//
+// Keys live in contiguous arrays searched without pointer chasing. The
+// search index is chosen by key type:
+//
+// - In general the keys are stored twice: in sorted order, for iteration and
+//   at(), and in Eytzinger (breadth-first) order, where the children of slot i
+//   are 2i and 2i + 1. A search touches one slot per level, the top levels share
+//   a few cache lines, and the slots four or so levels further down are
+//   prefetched while the current comparison runs. The descent has no
+//   data-dependent branch.
+// - Arithmetic keys ordered by std::less use a static B+ tree: the sorted keys
+//   form the leaves, and each inner node is one cache line of separators with
+//   one more child than it has keys. Every node is searched by counting its
+//   keys less than the target, with AVX2 or SSE2 when the build enables them.
+//   Floating point keys must not be NaN. Define FROZEN_TREE_NO_SIMD to count
+//   with plain compares only.
+#pragma once
+#include <algorithm>   // copy, fill, lower_bound, min
+#include <cstddef>     // size_t
+#include <functional>  // less
+#include <iterator>    // distance
+#include <limits>      // numeric_limits
+#include <stdexcept>   // out_of_range
+#include <type_traits> // enable_if, is_arithmetic
+#include <vector>
+
+#if defined(__SSE2__) && !defined(FROZEN_TREE_NO_SIMD)
+#define FROZEN_TREE_SIMD 1
+#include <immintrin.h>
+#endif
+
+template <typename T, typename Compare> class avl;
+
+// Keys that can be compared a cache line at a time with the builtin operator<.
+template <typename T, typename Compare>
+struct packed_keys : std::integral_constant<bool, std::is_arithmetic<T>::value && !std::is_same<T, bool>::value &&
+    (std::is_same<Compare, std::less<>>::value || std::is_same<Compare, std::less<T>>::value)> { };
+
+// Eytzinger index, for any key type and comparator.
+template <typename T, typename Compare, typename = void>
+class frozen_index
+{
+public:
+    // Let fill write the n sorted keys, then lay them out.
+    template <typename F>
+    void assign(std::size_t n, F fill)
+    {
+        sorted.resize(n);
+        fill(sorted.data());
+        eytz.resize(n + 1);
+        layout(sorted.data(), eytz.data(), n);
+    }
+
+    // Write the n sorted keys to e[1 .. n] in Eytzinger order.
+    static void layout(const T* sorted, T* e, std::size_t n)
+    {
+        std::size_t i = 0;
+        if (n)
+            layoutNode(sorted, e, n, 1, i);
+    }
+
+    const T* data() const { return sorted.data(); }
+    std::size_t bytes() const { return (sorted.capacity() + eytz.capacity()) * sizeof(T); }
+
+    // Position of the first key not less than key.
+    template <typename K>
+    std::size_t lowerBound(const K& key, std::size_t n, const Compare& comp) const
+    {
+        return lowerBound(eytz.data(), key, n, comp);
+    }
+
+    // The same search over any array laid out by layout().
+    template <typename K>
+    static std::size_t lowerBound(const T* e, const K& key, std::size_t n, const Compare& comp)
+    {
+        std::size_t k = 1;
+        while (k <= n)
+        {
+#if defined(__GNUC__)
+            __builtin_prefetch(e + std::min(k * prefetchStride, n));
+#endif
+            k = 2 * k + comp(e[k], key);
+        }
+        // Undo the right turns taken after the last left turn; that node is the answer.
+        k >>= trailingOnes(k) + 1;
+        return k ? rankOf(k, n) : n;
+    }
+
+    void swap(frozen_index& x)
+    {
+        sorted.swap(x.sorted);
+        eytz.swap(x.eytz);
+    }
+
+private:
+    // Slots this many levels apart are a cache line apart at the bottom of a search.
+    static constexpr std::size_t prefetchStride = sizeof(T) < 64 ? 64 / sizeof(T) : 1;
+
+    // Fill e from sorted by an in-order walk of the implicit tree.
+    static void layoutNode(const T* sorted, T* e, std::size_t n, std::size_t k, std::size_t& i)
+    {
+        if (2 * k <= n)
+            layoutNode(sorted, e, n, 2 * k, i);
+        e[k] = sorted[i++];
+        if (2 * k + 1 <= n)
+            layoutNode(sorted, e, n, 2 * k + 1, i);
+    }
+
+    // In-order position of slot k. In a perfect tree with h levels it follows
+    // from k's depth and offset within its level; the leaves missing from the
+    // last level are then subtracted, since they all sit at its right end.
+    static std::size_t rankOf(std::size_t k, std::size_t n)
+    {
+        unsigned h = floorLog2(n) + 1;
+        unsigned d = floorLog2(k);
+        std::size_t full = ((2 * (k - (std::size_t(1) << d)) + 1) << (h - 1 - d)) - 1;
+        std::size_t leaves = n - (std::size_t(1) << (h - 1)) + 1;
+        std::size_t before = (full + 1) / 2;
+        return full - (before > leaves ? before - leaves : 0);
+    }
+
+    static unsigned floorLog2(std::size_t x)
+    {
+#if defined(__GNUC__)
+        return static_cast<unsigned>(8 * sizeof(unsigned long long) - 1 - __builtin_clzll(x));
+#else
+        unsigned r = 0;
+        while (x >>= 1)
+            ++r;
+        return r;
+#endif
+    }
+
+    static unsigned trailingOnes(std::size_t x)
+    {
+#if defined(__GNUC__)
+        return static_cast<unsigned>(__builtin_ctzll(~static_cast<unsigned long long>(x)));
+#else
+        unsigned r = 0;
+        for (; x & 1; x >>= 1)
+            ++r;
+        return r;
+#endif
+    }
+
+    std::vector<T> sorted;        // Keys in order.
+    std::vector<T> eytz;          // Keys in breadth-first order from slot 1; slot 0 is unused.
+};
+
+// Tag selecting the Eytzinger index above for keys that would otherwise get
+// the B+ tree below, for code that needs one layout for every key type.
+struct eytzinger_layout { };
+
+template <typename T, typename Compare>
+using eytzinger_index = frozen_index<T, Compare, eytzinger_layout>;
+
+// Static B+ tree index for arithmetic keys.
+template <typename T, typename Compare>
+class frozen_index<T, Compare, typename std::enable_if<packed_keys<T, Compare>::value>::type>
+{
+    static constexpr std::size_t B = 64 / sizeof(T);    // Keys per node, one cache line.
+
+    struct alignas(64) block
+    {
+        T keys[B];
+    };
+    static_assert(sizeof(block) == B * sizeof(T), "nodes must be exactly one cache line of keys");
+
+public:
+    // Let fill write the n sorted keys into the leaves, then build the inner levels.
+    template <typename F>
+    void assign(std::size_t n, F fill)
+    {
+        std::size_t blocks = (n + B - 1) / B;
+        leaves.resize(blocks);
+        T* keys = blocks ? leaves[0].keys : nullptr;
+        fill(keys);
+        std::fill(keys + n, keys + blocks * B, pad());
+
+        // Level h above the leaves has one block per B + 1 blocks of level h - 1.
+        std::vector<std::size_t> counts;
+        for (std::size_t m = blocks; m > 1; )
+        {
+            m = (m + B) / (B + 1);
+            counts.push_back(m);
+        }
+        levels.resize(counts.size());
+        std::size_t total = 0;
+        for (std::size_t h = counts.size(); h-- > 0; )
+        {
+            levels[counts.size() - 1 - h] = total;
+            total += counts[h];
+        }
+        inner.resize(total);
+
+        // Separator c of a node is the first key under its child c + 1.
+        std::size_t span = B;                           // Keys under each child of the current level.
+        for (std::size_t h = 0; h < counts.size(); ++h, span *= B + 1)
+        {
+            block* level = inner.data() + levels[counts.size() - 1 - h];
+            for (std::size_t j = 0; j < counts[h]; ++j)
+                for (std::size_t c = 0; c < B; ++c)
+                {
+                    std::size_t first = (j * (B + 1) + c + 1) * span;
+                    level[j].keys[c] = first < n ? keys[first] : pad();
+                }
+        }
+    }
+
+    const T* data() const { return leaves.empty() ? nullptr : leaves[0].keys; }
+    std::size_t bytes() const { return (leaves.capacity() + inner.capacity()) * sizeof(block); }
+
+    // Position of the first key not less than key. Keys of another type are
+    // compared as that type, so they go through a plain binary search.
+    template <typename K>
+    std::size_t lowerBound(const K& key, std::size_t n, const Compare& comp) const
+    {
+        if constexpr (!std::is_same<K, T>::value)
+            return static_cast<std::size_t>(std::lower_bound(data(), data() + n, key, comp) - data());
+        else
+        {
+            if (n == 0)
+                return 0;
+            std::size_t k = 0;
+            for (std::size_t start : levels)
+                k = k * (B + 1) + countLess(inner[start + k].keys, key);
+            std::size_t r = k * B + countLess(leaves[k].keys, key);
+            return r < n ? r : n;
+        }
+    }
+
+    void swap(frozen_index& x)
+    {
+        leaves.swap(x.leaves);
+        inner.swap(x.inner);
+        levels.swap(x.levels);
+    }
+
+private:
+    // Fills the unused slots; never less than a key, so never counted.
+    static T pad()
+    {
+        return std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max();
+    }
+
+    // Number of the B keys of a node less than x.
+    static unsigned countLess(const T* keys, T x)
+    {
+#if defined(FROZEN_TREE_SIMD) && defined(__AVX2__)
+        if constexpr (std::is_integral<T>::value && std::is_signed<T>::value && sizeof(T) == 4)
+        {
+            __m256i v = _mm256_set1_epi32(static_cast<int>(x));
+            const __m256i* p = reinterpret_cast<const __m256i*>(keys);
+            int lo = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, _mm256_load_si256(p))));
+            int hi = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, _mm256_load_si256(p + 1))));
+            return static_cast<unsigned>(__builtin_popcount(lo | hi << 8));
+        }
+        if constexpr (std::is_integral<T>::value && std::is_signed<T>::value && sizeof(T) == 8)
+        {
+            __m256i v = _mm256_set1_epi64x(static_cast<long long>(x));
+            const __m256i* p = reinterpret_cast<const __m256i*>(keys);
+            int lo = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, _mm256_load_si256(p))));
+            int hi = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, _mm256_load_si256(p + 1))));
+            return static_cast<unsigned>(__builtin_popcount(lo | hi << 4));
+        }
+        if constexpr (std::is_same<T, float>::value)
+        {
+            __m256 v = _mm256_set1_ps(x);
+            int lo = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_load_ps(keys), v, _CMP_LT_OQ));
+            int hi = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_load_ps(keys + 8), v, _CMP_LT_OQ));
+            return static_cast<unsigned>(__builtin_popcount(lo | hi << 8));
+        }
+        if constexpr (std::is_same<T, double>::value)
+        {
+            __m256d v = _mm256_set1_pd(x);
+            int lo = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_load_pd(keys), v, _CMP_LT_OQ));
+            int hi = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_load_pd(keys + 4), v, _CMP_LT_OQ));
+            return static_cast<unsigned>(__builtin_popcount(lo | hi << 4));
+        }
+#elif defined(FROZEN_TREE_SIMD)
+        if constexpr (std::is_integral<T>::value && std::is_signed<T>::value && sizeof(T) == 4)
+        {
+            __m128i v = _mm_set1_epi32(static_cast<int>(x));
+            const __m128i* p = reinterpret_cast<const __m128i*>(keys);
+            int m = 0;
+            for (int i = 0; i < 4; ++i)
+                m |= _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, _mm_load_si128(p + i)))) << 4 * i;
+            return static_cast<unsigned>(__builtin_popcount(m));
+        }
+#if defined(__SSE4_2__)
+        if constexpr (std::is_integral<T>::value && std::is_signed<T>::value && sizeof(T) == 8)
+        {
+            __m128i v = _mm_set1_epi64x(static_cast<long long>(x));
+            const __m128i* p = reinterpret_cast<const __m128i*>(keys);
+            int m = 0;
+            for (int i = 0; i < 4; ++i)
+                m |= _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(v, _mm_load_si128(p + i)))) << 2 * i;
+            return static_cast<unsigned>(__builtin_popcount(m));
+        }
+#endif
+        if constexpr (std::is_same<T, float>::value)
+        {
+            __m128 v = _mm_set1_ps(x);
+            int m = 0;
+            for (int i = 0; i < 4; ++i)
+                m |= _mm_movemask_ps(_mm_cmplt_ps(_mm_load_ps(keys + 4 * i), v)) << 4 * i;
+            return static_cast<unsigned>(__builtin_popcount(m));
+        }
+        if constexpr (std::is_same<T, double>::value)
+        {
+            __m128d v = _mm_set1_pd(x);
+            int m = 0;
+            for (int i = 0; i < 4; ++i)
+                m |= _mm_movemask_pd(_mm_cmplt_pd(_mm_load_pd(keys + 2 * i), v)) << 2 * i;
+            return static_cast<unsigned>(__builtin_popcount(m));
+        }
+#endif
+        unsigned c = 0;
+        for (std::size_t i = 0; i < B; ++i)
+            c += keys[i] < x;
+        return c;
+    }
+
+    std::vector<block> leaves;         // The sorted keys, padded to whole nodes.
+    std::vector<block> inner;          // Separator nodes, level by level from the root.
+    std::vector<std::size_t> levels;   // Offset of each inner level in inner, root first.
+};
+
+template <typename T, typename Compare = std::less<>>
+class frozen_tree
+{
+    template <typename, typename> friend class avl;
+
+public:
+    using value_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+    using size_type = std::size_t;
+    using const_iterator = const T*;
+    using iterator = const_iterator;
+
+    frozen_tree() { }
+    explicit frozen_tree(const Compare& c) : comp(c) { }
+    template <typename ForwardIt>
+    frozen_tree(ForwardIt first, ForwardIt last, const Compare& c = Compare()) : comp(c) { assign_sorted(first, last); }
+
+    // Replace the contents with the sorted range [first, last) in linear time.
+    // Storage is reused, so refreshing a snapshot of the same size allocates nothing.
+    template <typename ForwardIt>
+    void assign_sorted(ForwardIt first, ForwardIt last)
+    {
+        assignWith(static_cast<std::size_t>(std::distance(first, last)), [&](T* out) { std::copy(first, last, out); });
+    }
+
+    key_compare key_comp() const { return comp; }
+    value_compare value_comp() const { return comp; }
+
+    const_iterator begin() const { return index.data(); }
+    const_iterator end() const { return index.data() + count; }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    const_iterator at(std::size_t i) const
+    {
+        if (i >= size())
+            throw std::out_of_range("frozen_tree::at out-of-range");
+        return begin() + i;
+    }
+    const T& operator[] (std::size_t i) const { return begin()[i]; }
+
+    // Lookups take the same time whatever the outcome; the template overloads
+    // accept any key type when Compare is transparent.
+    const_iterator lower_bound(const T& t) const { return begin() + rank(t); }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    const_iterator lower_bound(const K& k) const { return begin() + rank(k); }
+
+    const_iterator find(const T& t) const { return findRank(t); }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    const_iterator find(const K& k) const { return findRank(k); }
+
+    bool contains(const T& t) const { return find(t) != end(); }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    bool contains(const K& k) const { return find(k) != end(); }
+
+    // Number of elements less than t.
+    std::size_t rank(const T& t) const { return index.lowerBound(t, count, comp); }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    std::size_t rank(const K& k) const { return index.lowerBound(k, count, comp); }
+
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    // Bytes held by the keys and the search index.
+    std::size_t bytes() const { return index.bytes(); }
+
+    void swap(frozen_tree& f)
+    {
+        index.swap(f.index);
+        std::swap(count, f.count);
+        std::swap(comp, f.comp);
+    }
+
+private:
+    // Rebuild from n sorted keys written by fill(T* out).
+    template <typename F>
+    void assignWith(std::size_t n, F fill)
+    {
+        count = 0;
+        index.assign(n, fill);
+        count = n;
+    }
+
+    template <typename K>
+    const_iterator findRank(const K& key) const
+    {
+        std::size_t r = index.lowerBound(key, count, comp);
+        return r != count && !comp(key, begin()[r]) ? begin() + r : end();
+    }
+
+    frozen_index<T, Compare> index;
+    std::size_t count = 0;
+    Compare comp;
+};
+
+template <typename T, typename Compare>
+void swap(frozen_tree<T, Compare>& f1, frozen_tree<T, Compare>& f2) { f1.swap(f2); }
@@ -0,0 +1,330 @@
+// Read-only ordered set served straight from a file written by tree<T>::save.
+//
+// The file holds a 64-byte header followed by the keys twice, in sorted order
+// and in the Eytzinger order frozen_tree searches, each section at a 64-byte
+// aligned offset. Sections are located by offset only, so the file is
+// position independent: mapped_tree maps it and answers lookups in place,
+// without building anything. Opening costs one mmap plus, when asked to
+// verify, one pass over the file for the checksum. Converting to a mutable
+// tree<T> is a linear-time assign_sorted from the mapped keys, which can wait
+// until the first write.
+//
+// Only trivially copyable keys can be saved, and a file is only readable on
+// a machine with the same byte order and the same layout of T.
+#pragma once
+#include <cstddef>      // size_t
+#include <cstdint>      // uint32_t, uint64_t
+#include <cstdio>       // rename, remove
+#include <cstring>      // memcpy, memcmp
+#include <fstream>
+#include <functional>   // less
+#include <new>          // align_val_t
+#include <stdexcept>    // runtime_error, out_of_range
+#include <string>
+#include <system_error>
+#include <type_traits>  // is_trivially_copyable
+#include <utility>      // swap
+#include <vector>
+
+#include "frozen_tree.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MAPPED_TREE_MMAP 1
+#endif
+
+struct mapped_tree_header
+{
+    char magic[8];                  // "AVLTREE"
+    std::uint32_t version;
+    std::uint32_t byteOrder;        // byteOrderMark as written.
+    std::uint32_t keySize;
+    std::uint32_t keyAlign;
+    std::uint64_t count;
+    std::uint64_t sortedOffset;     // Sorted keys.
+    std::uint64_t eytzOffset;       // Eytzinger keys; slot 0 is unused.
+    std::uint64_t checksum;         // Of both key sections.
+    std::uint64_t reserved;
+
+    static constexpr char magicBytes[8] = { 'A', 'V', 'L', 'T', 'R', 'E', 'E', 0 };
+    static constexpr std::uint32_t currentVersion = 1;
+    static constexpr std::uint32_t byteOrderMark = 0x01020304;
+    static constexpr std::size_t sectionAlign = 64;
+
+    // Offset of the first section boundary at or after pos.
+    static std::uint64_t alignUp(std::uint64_t pos) { return (pos + sectionAlign - 1) / sectionAlign * sectionAlign; }
+
+    // Hash of bytes, eight at a time; continues from h.
+    static std::uint64_t hash(const void* bytes, std::size_t n, std::uint64_t h = 0x9e3779b97f4a7c15ull)
+    {
+        const unsigned char* p = static_cast<const unsigned char*>(bytes);
+        for (; n >= 8; n -= 8, p += 8)
+        {
+            std::uint64_t w;
+            std::memcpy(&w, p, 8);
+            h = (h ^ w) * 0x100000001b3ull;
+            h ^= h >> 29;
+        }
+        for (; n; --n, ++p)
+            h = (h ^ *p) * 0x100000001b3ull;
+        return h;
+    }
+};
+static_assert(sizeof(mapped_tree_header) == 64, "the header is one cache line");
+
+// Write n sorted keys, produced by fill(T* out), to path in the format above.
+// The file is written beside path and then renamed over it, so processes that
+// have the old file mapped keep reading the old contents.
+template <typename T, typename Compare, typename F>
+void save_mapped_tree(const std::string& path, std::size_t n, F fill)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "only trivially copyable keys can be saved");
+    using H = mapped_tree_header;
+    std::vector<T> sorted(n);
+    std::vector<T> eytz(n + 1);
+    if (n)
+    {
+        fill(sorted.data());
+        eytzinger_index<T, Compare>::layout(sorted.data(), eytz.data(), n);
+    }
+
+    H h = { };
+    std::memcpy(h.magic, H::magicBytes, sizeof(h.magic));
+    h.version = H::currentVersion;
+    h.byteOrder = H::byteOrderMark;
+    h.keySize = sizeof(T);
+    h.keyAlign = alignof(T);
+    h.count = n;
+    h.sortedOffset = H::alignUp(sizeof(H));
+    h.eytzOffset = H::alignUp(h.sortedOffset + n * sizeof(T));
+    h.checksum = H::hash(eytz.data(), (n + 1) * sizeof(T), H::hash(sorted.data(), n * sizeof(T)));
+
+    std::string tmp = path + ".tmp";
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    const char zeros[H::sectionAlign] = { };
+    out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    out.write(zeros, static_cast<std::streamsize>(h.sortedOffset - sizeof(h)));
+    out.write(reinterpret_cast<const char*>(sorted.data()), static_cast<std::streamsize>(n * sizeof(T)));
+    out.write(zeros, static_cast<std::streamsize>(h.eytzOffset - h.sortedOffset - n * sizeof(T)));
+    out.write(reinterpret_cast<const char*>(eytz.data()), static_cast<std::streamsize>((n + 1) * sizeof(T)));
+    out.close();
+    if (!out)
+    {
+        std::remove(tmp.c_str());
+        throw std::runtime_error("mapped_tree: cannot write " + tmp);
+    }
+#if !defined(MAPPED_TREE_MMAP)
+    // rename does not replace an existing file everywhere
+    std::remove(path.c_str());
+#endif
+    if (std::rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        std::remove(tmp.c_str());
+        throw std::runtime_error("mapped_tree: cannot replace " + path);
+    }
+}
+
+template <typename T, typename Compare = std::less<>>
+class mapped_tree
+{
+    static_assert(std::is_trivially_copyable<T>::value, "only trivially copyable keys can be mapped");
+    using H = mapped_tree_header;
+    // The file always holds the Eytzinger layout, whatever the key type.
+    using index = eytzinger_index<T, Compare>;
+
+public:
+    using value_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+    using size_type = std::size_t;
+    using const_iterator = const T*;
+    using iterator = const_iterator;
+
+    mapped_tree() { }
+    // Map path, checking its header and, with verify, the checksum of its keys.
+    explicit mapped_tree(const std::string& path, bool verify = true, const Compare& c = Compare()) : comp(c)
+    {
+        open(path);
+        try
+        {
+            check(path, verify);
+        }
+        catch (...)
+        {
+            close();
+            throw;
+        }
+    }
+    mapped_tree(const mapped_tree&) = delete;
+    mapped_tree& operator= (const mapped_tree&) = delete;
+    mapped_tree(mapped_tree&& m) noexcept { swap(m); }
+    mapped_tree& operator= (mapped_tree&& m) noexcept
+    {
+        mapped_tree(std::move(m)).swap(*this);
+        return *this;
+    }
+    ~mapped_tree() { close(); }
+
+    key_compare key_comp() const { return comp; }
+    value_compare value_comp() const { return comp; }
+
+    const_iterator begin() const { return sorted; }
+    const_iterator end() const { return sorted + count; }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    const_iterator at(std::size_t i) const
+    {
+        if (i >= size())
+            throw std::out_of_range("mapped_tree::at out-of-range");
+        return begin() + i;
+    }
+    const T& operator[] (std::size_t i) const { return begin()[i]; }
+
+    const_iterator lower_bound(const T& t) const { return begin() + rank(t); }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    const_iterator lower_bound(const K& k) const { return begin() + rank(k); }
+
+    const_iterator find(const T& t) const { return findRank(t); }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    const_iterator find(const K& k) const { return findRank(k); }
+
+    bool contains(const T& t) const { return find(t) != end(); }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    bool contains(const K& k) const { return find(k) != end(); }
+
+    // Number of elements less than t.
+    std::size_t rank(const T& t) const { return index::lowerBound(eytz, t, count, comp); }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    std::size_t rank(const K& k) const { return index::lowerBound(eytz, k, count, comp); }
+
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    void swap(mapped_tree& m) noexcept
+    {
+        std::swap(base, m.base);
+        std::swap(length, m.length);
+        std::swap(mapped, m.mapped);
+        std::swap(sorted, m.sorted);
+        std::swap(eytz, m.eytz);
+        std::swap(count, m.count);
+        std::swap(comp, m.comp);
+    }
+
+private:
+    // Map the file, or read it into memory where mmap is unavailable.
+    void open(const std::string& path)
+    {
+#if defined(MAPPED_TREE_MMAP)
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), "mapped_tree: cannot open " + path);
+        struct stat st;
+        if (::fstat(fd, &st) != 0)
+        {
+            int e = errno;
+            ::close(fd);
+            throw std::system_error(e, std::generic_category(), "mapped_tree: cannot stat " + path);
+        }
+        length = static_cast<std::size_t>(st.st_size);
+        if (length)
+        {
+            void* p = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED)
+            {
+                int e = errno;
+                ::close(fd);
+                throw std::system_error(e, std::generic_category(), "mapped_tree: cannot map " + path);
+            }
+            base = static_cast<const char*>(p);
+            mapped = true;
+        }
+        ::close(fd);
+#else
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in)
+            throw std::runtime_error("mapped_tree: cannot open " + path);
+        length = static_cast<std::size_t>(in.tellg());
+        // Sections are 64-byte aligned relative to the start of the buffer.
+        char* p = static_cast<char*>(::operator new(length, std::align_val_t(H::sectionAlign)));
+        base = p;
+        in.seekg(0);
+        if (!in.read(p, static_cast<std::streamsize>(length)))
+        {
+            close();
+            throw std::runtime_error("mapped_tree: cannot read " + path);
+        }
+#endif
+    }
+
+    void close() noexcept
+    {
+        if (!base)
+            return;
+#if defined(MAPPED_TREE_MMAP)
+        if (mapped)
+            ::munmap(const_cast<char*>(base), length);
+#else
+        ::operator delete(const_cast<char*>(base), std::align_val_t(H::sectionAlign));
+#endif
+        base = nullptr;
+        length = 0;
+        sorted = eytz = nullptr;
+        count = 0;
+    }
+
+    void check(const std::string& path, bool verify)
+    {
+        auto fail = [&](const char* what) { throw std::runtime_error("mapped_tree: " + path + ": " + what); };
+        H h;
+        if (length < sizeof(h))
+            fail("truncated header");
+        std::memcpy(&h, base, sizeof(h));
+        if (std::memcmp(h.magic, H::magicBytes, sizeof(h.magic)) != 0)
+            fail("not a tree file");
+        if (h.version != H::currentVersion)
+            fail("unsupported version");
+        if (h.byteOrder != H::byteOrderMark)
+            fail("written with another byte order");
+        if (h.keySize != sizeof(T) || h.keyAlign != alignof(T))
+            fail("key type does not match");
+        // count + 1 keys must fit, which also keeps bytes below from overflowing
+        if (h.count >= length / sizeof(T))
+            fail("bad key count");
+        std::uint64_t bytes = h.count * sizeof(T);
+        // Header fields are untrusted: compare without sums that could wrap.
+        auto fits = [&](std::uint64_t offset, std::uint64_t size) { return offset <= length && size <= length - offset; };
+        if (h.sortedOffset % H::sectionAlign || h.eytzOffset % H::sectionAlign || h.sortedOffset < sizeof(h)
+            || h.eytzOffset < h.sortedOffset || h.eytzOffset - h.sortedOffset < bytes
+            || !fits(h.sortedOffset, bytes) || !fits(h.eytzOffset, bytes + sizeof(T)))
+            fail("bad section offsets");
+        sorted = reinterpret_cast<const T*>(base + h.sortedOffset);
+        eytz = reinterpret_cast<const T*>(base + h.eytzOffset);
+        count = static_cast<std::size_t>(h.count);
+        if (verify && H::hash(eytz, bytes + sizeof(T), H::hash(sorted, bytes)) != h.checksum)
+            fail("checksum mismatch");
+    }
+
+    template <typename K>
+    const_iterator findRank(const K& key) const
+    {
+        std::size_t r = index::lowerBound(eytz, key, count, comp);
+        return r != count && !comp(key, begin()[r]) ? begin() + r : end();
+    }
+
+    const char* base = nullptr;     // The whole file.
+    std::size_t length = 0;
+    bool mapped = false;
+    const T* sorted = nullptr;
+    const T* eytz = nullptr;
+    std::size_t count = 0;
+    Compare comp;
+};
+
+template <typename T, typename Compare>
+void swap(mapped_tree<T, Compare>& m1, mapped_tree<T, Compare>& m2) { m1.swap(m2); }
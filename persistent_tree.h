@@ -0,0 +1,428 @@
+// Persistent AVL tree for one writer and any number of lock-free readers.
+//
+// Nodes are immutable and shared between versions through shared_ptr. An
+// insert or erase copies the path from the root to the changed node,
+// rebalancing the copies on the way back up, and publishes the new root
+// through an atomic pointer; every other node is shared with the previous
+// version. Readers take a snapshot, which holds a reference to the root of
+// the version current at that time. Lookups on a snapshot only read immutable
+// nodes, and nodes are freed when the last version using them goes away.
+//
+// Taking a snapshot takes no lock: the reader registers in a per-thread
+// stripe, loads the published version and copies its root, which costs one
+// reference count increment, and deregisters. A version the writer replaces
+// is deleted only after the readers that might have loaded it have left, as
+// in concurrent_avl. Readers retry only if a reclaim starts while they
+// register, so the writer never blocks them; the writer may wait briefly
+// for readers in that short window. Readers should still keep a snapshot for
+// a batch of lookups rather than take one per lookup.
+//
+// Copying a persistent_tree is O(1) as well: the copy shares every node, and
+// each later write to either tree copies only the path it changes. tree<T>
+// cannot share nodes this way, as its nodes link back to their parents.
+#pragma once
+#include <algorithm>  // max
+#include <atomic>
+#include <cstddef>    // size_t
+#include <functional> // less
+#include <iterator>   // forward_iterator_tag
+#include <memory>     // shared_ptr
+#include <mutex>      // writer lock
+#include <stdexcept>  // out_of_range
+#include <thread>     // yield
+#include <utility>    // move
+#include <vector>     // iterator paths, retired versions
+
+template <typename T, typename Compare = std::less<>>
+class persistent_tree
+{
+    struct node;
+    using link = std::shared_ptr<const node>;
+
+    struct node
+    {
+        T data;
+        link left;
+        link right;
+        std::size_t n;
+        short depth;
+
+        node(const T& t, link l, link r)
+            : data(t), left(std::move(l)), right(std::move(r)),
+            n(1 + sizeOf(left.get()) + sizeOf(right.get())),
+            depth(static_cast<short>(1 + std::max(depthOf(left.get()), depthOf(right.get())))) { }
+    };
+
+    // A published root; readers copy root out of the current one.
+    struct version
+    {
+        link root;
+    };
+
+    // Readers in flight in each of the two epoch parities, on their own cache line.
+    struct alignas(64) stripe
+    {
+        std::atomic<std::size_t> active[2] = { };
+    };
+
+public:
+    using value_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+
+    // In-order iterator over a snapshot; it keeps the nodes it has yet to visit.
+    class const_iterator
+    {
+        friend class persistent_tree;
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        const_iterator() { }
+
+        bool operator== (const const_iterator& it) const { return current() == it.current(); }
+        bool operator!= (const const_iterator& it) const { return current() != it.current(); }
+
+        const_iterator& operator++ ()
+        {
+            const node* p = path.back();
+            path.pop_back();
+            for (p = p->right.get(); p; p = p->left.get())
+                path.push_back(p);
+            return *this;
+        }
+        const_iterator operator++ (int)
+        {
+            const_iterator old(*this);
+            ++(*this);
+            return old;
+        }
+
+        const T& operator* () const { return path.back()->data; }
+        const T* operator-> () const { return &path.back()->data; }
+
+    private:
+        const node* current() const { return path.empty() ? nullptr : path.back(); }
+
+        std::vector<const node*> path;   // Current node on top, below it the ancestors still to visit.
+    };
+    using iterator = const_iterator;
+
+    // A read-only version of the tree, unaffected by later writes.
+    class snapshot
+    {
+        friend class persistent_tree;
+
+    public:
+        snapshot() { }
+
+        const_iterator begin() const
+        {
+            const_iterator it;
+            for (const node* p = root.get(); p; p = p->left.get())
+                it.path.push_back(p);
+            return it;
+        }
+        const_iterator end() const { return const_iterator(); }
+        const_iterator cbegin() const { return begin(); }
+        const_iterator cend() const { return end(); }
+
+        const_iterator at(std::size_t i) const
+        {
+            if (i >= size())
+                throw std::out_of_range("persistent_tree::at out-of-range");
+            const_iterator it;
+            const node* p = root.get();
+            while (true)
+            {
+                std::size_t l = sizeOf(p->left.get());
+                if (i == l)
+                    break;
+                if (i < l)
+                {
+                    it.path.push_back(p);
+                    p = p->left.get();
+                }
+                else
+                {
+                    i -= l + 1;
+                    p = p->right.get();
+                }
+            }
+            it.path.push_back(p);
+            return it;
+        }
+        const T& operator[] (std::size_t i) const { return *at(i); }
+
+        // First element not less than k.
+        template <typename K>
+        const_iterator lower_bound(const K& k) const
+        {
+            const_iterator it;
+            for (const node* p = root.get(); p; )
+            {
+                if (comp(p->data, k))
+                    p = p->right.get();
+                else
+                {
+                    it.path.push_back(p);
+                    p = p->left.get();
+                }
+            }
+            return it;
+        }
+
+        template <typename K>
+        const_iterator find(const K& k) const
+        {
+            const_iterator it = lower_bound(k);
+            return it != end() && !comp(k, *it) ? it : end();
+        }
+
+        template <typename K>
+        bool contains(const K& k) const
+        {
+            const node* res = nullptr;
+            for (const node* p = root.get(); p; )
+            {
+                if (comp(p->data, k))
+                    p = p->right.get();
+                else
+                {
+                    res = p;
+                    p = p->left.get();
+                }
+            }
+            return res && !comp(k, res->data);
+        }
+
+        std::size_t size() const { return sizeOf(root.get()); }
+        bool empty() const { return !root; }
+
+    private:
+        snapshot(link r, const Compare& c) : root(std::move(r)), comp(c) { }
+
+        link root;
+        Compare comp;
+    };
+
+    persistent_tree() : current(new version()) { }
+    explicit persistent_tree(const Compare& c) : current(new version()), comp(c) { }
+    // A writable tree starting from the version s holds.
+    explicit persistent_tree(const snapshot& s) : current(new version{ s.root }), comp(s.comp) { }
+    persistent_tree(const persistent_tree& t) : current(new version{ t.read().root }), comp(t.comp) { }
+    persistent_tree& operator= (const persistent_tree& t)
+    {
+        if (this != &t)
+        {
+            link r = t.read().root;
+            std::lock_guard<std::mutex> lock(writer);
+            comp = t.comp;
+            publish(std::move(r));
+        }
+        return *this;
+    }
+
+    // No snapshot refers to a version object, so none can be in use here.
+    ~persistent_tree()
+    {
+        delete current.load();
+        for (const version* v : retired)
+            delete v;
+    }
+
+    // The current version; safe to call from any thread at any time.
+    snapshot read() const
+    {
+        unsigned parity = enter();
+        link r = current.load()->root;
+        leave(parity);
+        return snapshot(std::move(r), comp);
+    }
+
+    // Writers are serialized with each other but never block readers.
+
+    // Replace the contents with the sorted range [first, last) in linear time.
+    template <typename ForwardIt>
+    void assign_sorted(ForwardIt first, ForwardIt last)
+    {
+        std::lock_guard<std::mutex> lock(writer);
+        std::size_t n = static_cast<std::size_t>(std::distance(first, last));
+        publish(buildNode(first, n));
+    }
+
+    // As with tree<T>, an element equal to existing ones goes after them.
+    void insert(const T& t)
+    {
+        std::lock_guard<std::mutex> lock(writer);
+        publish(insertNode(rootNode(), t));
+    }
+
+    // Remove one element equivalent to k; returns whether there was one.
+    template <typename K>
+    bool erase(const K& k)
+    {
+        std::lock_guard<std::mutex> lock(writer);
+        bool erased = false;
+        link r = eraseNode(rootNode(), k, erased);
+        if (erased)
+            publish(std::move(r));
+        return erased;
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(writer);
+        publish(link());
+    }
+
+private:
+    // Root of the current version; only the writer may call this.
+    const node* rootNode() const { return current.load()->root.get(); }
+
+    // Make r the current version and retire the one it replaces. Called with
+    // the writer lock held.
+    void publish(link r)
+    {
+        retired.push_back(current.exchange(new version{ std::move(r) }));
+        if (retired.size() >= reclaimBatch)
+            reclaim();
+    }
+
+    // Flip the epoch and wait for readers registered under the old parity;
+    // those registered since can only have loaded a version published after
+    // everything retired so far.
+    void reclaim()
+    {
+        unsigned old = epoch.fetch_add(1) & 1;
+        for (stripe& s : readers)
+            while (s.active[old].load() != 0)
+                std::this_thread::yield();
+        for (const version* v : retired)
+            delete v;
+        retired.clear();
+    }
+
+    static unsigned stripeOf()
+    {
+        static std::atomic<unsigned> next{ 0 };
+        thread_local unsigned s = next.fetch_add(1, std::memory_order_relaxed) % stripes;
+        return s;
+    }
+
+    unsigned enter() const
+    {
+        stripe& s = readers[stripeOf()];
+        while (true)
+        {
+            unsigned e = epoch.load();
+            s.active[e & 1].fetch_add(1);
+            if (epoch.load() == e)
+                return e & 1;
+            s.active[e & 1].fetch_sub(1);
+        }
+    }
+
+    void leave(unsigned parity) const { readers[stripeOf()].active[parity].fetch_sub(1); }
+
+    static std::size_t sizeOf(const node* p) { return p ? p->n : 0; }
+    static short depthOf(const node* p) { return p ? p->depth : 0; }
+
+    static link makeNode(const T& t, link l, link r) { return std::make_shared<const node>(t, std::move(l), std::move(r)); }
+
+    // A node holding t over l and r, rotated if their depths differ by two.
+    static link balance(const T& t, link l, link r)
+    {
+        short dl = depthOf(l.get());
+        short dr = depthOf(r.get());
+        if (dl > dr + 1)
+        {
+            if (depthOf(l->left.get()) >= depthOf(l->right.get()))
+                return makeNode(l->data, l->left, makeNode(t, l->right, std::move(r)));
+            // double-rotation case
+            const node* lr = l->right.get();
+            return makeNode(lr->data, makeNode(l->data, l->left, lr->left), makeNode(t, lr->right, std::move(r)));
+        }
+        if (dr > dl + 1)
+        {
+            if (depthOf(r->right.get()) >= depthOf(r->left.get()))
+                return makeNode(r->data, makeNode(t, std::move(l), r->left), r->right);
+            // double-rotation case
+            const node* rl = r->left.get();
+            return makeNode(rl->data, makeNode(t, std::move(l), rl->left), makeNode(r->data, rl->right, r->right));
+        }
+        return makeNode(t, std::move(l), std::move(r));
+    }
+
+    link insertNode(const node* p, const T& t) const
+    {
+        if (!p)
+            return makeNode(t, nullptr, nullptr);
+        if (comp(t, p->data))
+            return balance(p->data, insertNode(p->left.get(), t), p->right);
+        return balance(p->data, p->left, insertNode(p->right.get(), t));
+    }
+
+    template <typename K>
+    link eraseNode(const node* p, const K& k, bool& erased) const
+    {
+        if (!p)
+            return nullptr;
+        if (comp(p->data, k))
+        {
+            link r = eraseNode(p->right.get(), k, erased);
+            return erased ? balance(p->data, p->left, std::move(r)) : nullptr;
+        }
+        if (comp(k, p->data))
+        {
+            link l = eraseNode(p->left.get(), k, erased);
+            return erased ? balance(p->data, std::move(l), p->right) : nullptr;
+        }
+        erased = true;
+        if (!p->left)
+            return p->right;
+        if (!p->right)
+            return p->left;
+        // replace p by its successor
+        const T* successor;
+        link r = eraseMin(p->right.get(), successor);
+        return balance(*successor, p->left, std::move(r));
+    }
+
+    // p without its least element, which is returned through least.
+    static link eraseMin(const node* p, const T*& least)
+    {
+        if (!p->left)
+        {
+            least = &p->data;
+            return p->right;
+        }
+        return balance(p->data, eraseMin(p->left.get(), least), p->right);
+    }
+
+    template <typename It>
+    static link buildNode(It& it, std::size_t n)
+    {
+        if (n == 0)
+            return nullptr;
+        link l = buildNode(it, n / 2);
+        T t = *it;
+        ++it;
+        link r = buildNode(it, n - n / 2 - 1);
+        return makeNode(t, std::move(l), std::move(r));
+    }
+
+    static constexpr unsigned stripes = 16;
+    static constexpr std::size_t reclaimBatch = 64;    // Retired versions that trigger a reclaim.
+
+    std::mutex writer;                          // Serializes writers; readers never take it.
+    std::atomic<const version*> current;
+    std::vector<const version*> retired;        // Replaced, waiting for older readers to leave.
+    mutable stripe readers[stripes];
+    std::atomic<unsigned> epoch{ 0 };
+    Compare comp;
+};
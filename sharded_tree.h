@@ -0,0 +1,334 @@
+// Ordered multiset split by key range into independently locked tree<T> shards.
+//
+// Splitter keys route each element to one shard: shard i holds the elements
+// not less than splitter i - 1 and less than splitter i. Writers to different
+// shards run in parallel, each holding only its shard's mutex. The splitters
+// start out empty, so everything lands in shard 0, and are chosen again when
+// one shard grows well past its share: a re-split stops all operations for
+// long enough to concatenate the shards and split the result into equal
+// parts, O(shards * log n) with tree<T>'s join and split.
+//
+// Operations hold the layout in shared mode while they route and work, through
+// one of several lock stripes so readers of the layout do not share a cache
+// line; re-splitting takes every stripe exclusively.
+//
+// Keys that keep increasing all go to the last shard, so an append-only stream
+// gains nothing from sharding until it is spread over a wider range.
+#pragma once
+#include <algorithm>    // upper_bound, max
+#include <atomic>
+#include <cstddef>      // size_t
+#include <functional>   // less
+#include <iterator>     // forward_iterator_tag
+#include <memory>       // unique_ptr, allocator
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>    // out_of_range
+#include <thread>       // hardware_concurrency
+#include <utility>      // move
+#include <vector>
+
+#include "avl_tree_with_iterators.h"
+
+template <typename T, typename Compare = std::less<>, typename Alloc = std::allocator<T>>
+class sharded_tree
+{
+    using shard_tree = tree<T, Compare, Alloc>;
+
+    struct alignas(64) shard
+    {
+        shard(const Compare& c, const Alloc& a) : t(c, a) { }
+
+        // Publish the new size; returns whether it is time to check for skew.
+        bool wrote()
+        {
+            n.store(t.size(), std::memory_order_relaxed);
+            return ++writes % checkInterval == 0;
+        }
+
+        std::mutex m;
+        shard_tree t;
+        std::atomic<std::size_t> n{ 0 };    // t.size(), readable without m.
+        std::size_t writes = 0;
+    };
+
+    struct alignas(64) stripe
+    {
+        std::shared_mutex m;
+    };
+
+public:
+    using value_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+    using allocator_type = Alloc;
+
+    // In-order iterator across the shards. Iterating is only safe while no
+    // other thread writes; use for_each while writers run.
+    class const_iterator
+    {
+        friend class sharded_tree;
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        const_iterator() { }
+
+        bool operator== (const const_iterator& it) const { return i == it.i && p == it.p; }
+        bool operator!= (const const_iterator& it) const { return !(*this == it); }
+
+        const_iterator& operator++ ()
+        {
+            ++p;
+            skipEmpty();
+            return *this;
+        }
+        const_iterator operator++ (int)
+        {
+            const_iterator old(*this);
+            ++(*this);
+            return old;
+        }
+
+        const T& operator* () const { return *p; }
+        const T* operator-> () const { return &*p; }
+
+    private:
+        const_iterator(const sharded_tree* st, std::size_t i, typename shard_tree::const_iterator p)
+            : st(st), i(i), p(p) { skipEmpty(); }
+
+        // Move on to the next shard at the end of one, except after the last.
+        void skipEmpty()
+        {
+            while (p == st->shards[i]->t.cend() && i + 1 < st->shards.size())
+                p = st->shards[++i]->t.cbegin();
+        }
+
+        const sharded_tree* st = nullptr;
+        std::size_t i = 0;
+        typename shard_tree::const_iterator p;
+    };
+    using iterator = const_iterator;
+
+    explicit sharded_tree(std::size_t shardCount = std::thread::hardware_concurrency(),
+        const Compare& c = Compare(), const Alloc& a = Alloc()) : comp(c)
+    {
+        if (shardCount == 0)
+            shardCount = 1;
+        shards.reserve(shardCount);
+        for (std::size_t i = 0; i < shardCount; ++i)
+            shards.emplace_back(new shard(c, a));
+    }
+    sharded_tree(const sharded_tree&) = delete;
+    sharded_tree& operator= (const sharded_tree&) = delete;
+
+    key_compare key_comp() const { return comp; }
+    value_compare value_comp() const { return comp; }
+
+    // The element operations below are safe to call from any number of threads.
+
+    void insert(const T& t)
+    {
+        if (withShard(t, [&](shard& s) { s.t.insert(t); return s.wrote(); }))
+            resplitIfSkewed();
+    }
+    void insert(T&& t)
+    {
+        // route before t is moved from
+        if (withShard(t, [&](shard& s) { s.t.insert(std::move(t)); return s.wrote(); }))
+            resplitIfSkewed();
+    }
+
+    // Erase every element equivalent to t; returns how many there were.
+    std::size_t remove(const T& t)
+    {
+        std::size_t n = 0;
+        if (withShard(t, [&](shard& s) { n = s.t.remove(t); return n && s.wrote(); }))
+            resplitIfSkewed();
+        return n;
+    }
+
+    bool contains(const T& t) const { return withShard(t, [&](shard& s) { return s.t.contains(t); }); }
+    std::size_t count(const T& t) const { return withShard(t, [&](shard& s) { return s.t.count(t); }); }
+
+    // Sum of the shard sizes; exact once writers have finished.
+    std::size_t size() const
+    {
+        std::size_t n = 0;
+        for (const std::unique_ptr<shard>& s : shards)
+            n += s->n.load(std::memory_order_relaxed);
+        return n;
+    }
+    bool empty() const { return size() == 0; }
+
+    // Copy of the i-th element in order, located from the shard sizes. The
+    // shards are locked together so the sizes agree with each other.
+    T at(std::size_t i) const
+    {
+        std::shared_lock<std::shared_mutex> layout(stripes[stripeOf()].m);
+        std::vector<std::unique_lock<std::mutex>> locks;
+        locks.reserve(shards.size());
+        for (const std::unique_ptr<shard>& s : shards)
+            locks.emplace_back(s->m);
+        for (const std::unique_ptr<shard>& s : shards)
+        {
+            if (i < s->t.size())
+                return s->t[i];
+            i -= s->t.size();
+        }
+        throw std::out_of_range("sharded_tree::at out-of-range");
+    }
+
+    // Call f on every element in order, locking one shard at a time: each
+    // shard is seen as of some moment, but not all shards at the same one.
+    // f must not call back into this tree.
+    template <typename F>
+    void for_each(F f) const
+    {
+        std::shared_lock<std::shared_mutex> layout(stripes[stripeOf()].m);
+        for (const std::unique_ptr<shard>& s : shards)
+        {
+            std::lock_guard<std::mutex> lock(s->m);
+            for (const T& t : s->t)
+                f(t);
+        }
+    }
+
+    const_iterator begin() const { return const_iterator(this, 0, shards[0]->t.cbegin()); }
+    const_iterator end() const { return const_iterator(this, shards.size() - 1, shards.back()->t.cend()); }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    void clear()
+    {
+        std::vector<std::unique_lock<std::shared_mutex>> layout = lockLayout();
+        for (std::unique_ptr<shard>& s : shards)
+        {
+            s->t.clear();
+            s->n.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Choose new splitters that divide the elements evenly and move the
+    // elements accordingly. Runs by itself when a shard grows past
+    // skewFactor times its share.
+    void resplit()
+    {
+        std::lock_guard<std::mutex> lock(resplitting);
+        resplitLocked();
+    }
+
+    std::size_t shard_count() const { return shards.size(); }
+    std::size_t shard_size(std::size_t i) const { return shards[i]->n.load(std::memory_order_relaxed); }
+
+private:
+    // Index of the shard holding t: the number of splitters not greater than t.
+    template <typename K>
+    std::size_t route(const K& k) const
+    {
+        return static_cast<std::size_t>(std::upper_bound(splitters.begin(), splitters.end(), k, comp) - splitters.begin());
+    }
+
+    template <typename K, typename F>
+    auto withShard(const K& k, F f) const
+    {
+        std::shared_lock<std::shared_mutex> layout(stripes[stripeOf()].m);
+        shard& s = *shards[route(k)];
+        std::lock_guard<std::mutex> lock(s.m);
+        return f(s);
+    }
+
+    std::vector<std::unique_lock<std::shared_mutex>> lockLayout()
+    {
+        std::vector<std::unique_lock<std::shared_mutex>> locks;
+        locks.reserve(stripeCount);
+        for (stripe& s : stripes)
+            locks.emplace_back(s.m);
+        return locks;
+    }
+
+    bool skewed() const
+    {
+        std::size_t total = 0, most = 0;
+        for (const std::unique_ptr<shard>& s : shards)
+        {
+            std::size_t n = s->n.load(std::memory_order_relaxed);
+            total += n;
+            most = std::max(most, n);
+        }
+        return most >= resplitMinimum && most * shards.size() > skewFactor * total;
+    }
+
+    // Re-split unless another thread already is.
+    void resplitIfSkewed()
+    {
+        std::unique_lock<std::mutex> lock(resplitting, std::try_to_lock);
+        if (lock && skewed())
+            resplitLocked();
+    }
+
+    void resplitLocked()
+    {
+        std::vector<std::unique_lock<std::shared_mutex>> layout = lockLayout();
+        shard_tree all(std::move(shards[0]->t));
+        for (std::size_t i = 1; i < shards.size(); ++i)
+            append(all, shards[i]->t);
+
+        std::size_t n = all.size(), k = shards.size();
+        std::vector<T> next;
+        if (n >= k)
+        {
+            next.reserve(k - 1);
+            for (std::size_t i = 1; i < k; ++i)
+                next.push_back(all[i * n / k]);
+        }
+        // split from the right so each split is O(log n)
+        for (std::size_t i = next.size(); i > 0; --i)
+        {
+            shards[i]->t = all.split(next[i - 1]);
+            shards[i]->n.store(shards[i]->t.size(), std::memory_order_relaxed);
+        }
+        for (std::size_t i = next.size() + 1; i < k; ++i)
+            shards[i]->n.store(0, std::memory_order_relaxed);
+        shards[0]->t = std::move(all);
+        shards[0]->n.store(shards[0]->t.size(), std::memory_order_relaxed);
+        splitters = std::move(next);
+    }
+
+    // Move the elements of b, none less than those of a, onto the end of a.
+    static void append(shard_tree& a, shard_tree& b)
+    {
+        if (b.empty())
+            return;
+        if (a.empty())
+        {
+            a = std::move(b);
+            return;
+        }
+        typename shard_tree::node_type h = b.extract(b.cbegin());
+        a = shard_tree::join(std::move(a), std::move(h.value()), std::move(b));
+    }
+
+    // Threads take turns among the stripes, as in concurrent_avl.
+    static unsigned stripeOf()
+    {
+        static std::atomic<unsigned> next{ 0 };
+        thread_local unsigned s = next.fetch_add(1, std::memory_order_relaxed) % stripeCount;
+        return s;
+    }
+
+    static constexpr unsigned stripeCount = 16;
+    static constexpr std::size_t checkInterval = 1024;     // Writes to a shard between skew checks.
+    static constexpr std::size_t skewFactor = 2;            // A shard this many times its share is skewed,
+    static constexpr std::size_t resplitMinimum = 4096;     // once it holds at least this many elements.
+
+    std::vector<std::unique_ptr<shard>> shards;
+    std::vector<T> splitters;               // shards.size() - 1 of them once split, none before.
+    mutable stripe stripes[stripeCount];
+    std::mutex resplitting;
+    Compare comp;
+};
@@ -0,0 +1,288 @@
+// Multi-threaded checks for the containers that allow concurrent access.
+//
+// Run under ThreadSanitizer as well as plainly; each test prints nothing when
+// it passes, and a failed check makes the program exit with 1.
+#include "avl_tree_with_iterators.h"
+#include "concurrent_avl_tree.h"
+#include "persistent_tree.h"
+#include "sharded_tree.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    std::atomic<int> failures{ 0 };
+
+#define CHECK(cond) \
+    do { if (!(cond)) { std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); ++failures; } } while (0)
+
+    // One writer appends 0, 1, 2, ...; every snapshot a reader takes must be a
+    // prefix of that sequence.
+    void testPersistentSnapshots()
+    {
+        const int n = 20000;
+        persistent_tree<int> t;
+        std::atomic<bool> done{ false };
+        std::vector<std::thread> readers;
+        for (int r = 0; r < 4; ++r)
+            readers.emplace_back([&]
+            {
+                std::size_t last = 0;
+                while (!done.load())
+                {
+                    persistent_tree<int>::snapshot s = t.read();
+                    std::size_t size = s.size();
+                    CHECK(size >= last);
+                    last = size;
+                    if (size)
+                        CHECK(s[size - 1] == static_cast<int>(size - 1) && s.contains(static_cast<int>(size / 2)));
+                }
+            });
+        for (int i = 0; i < n; ++i)
+            t.insert(i);
+        done.store(true);
+        for (std::thread& r : readers)
+            r.join();
+        CHECK(t.read().size() == static_cast<std::size_t>(n));
+
+        persistent_tree<int> copy(t);
+        for (int i = 0; i < n; i += 2)
+            copy.erase(i);
+        CHECK(t.read().size() == static_cast<std::size_t>(n) && copy.read().size() == static_cast<std::size_t>(n / 2));
+    }
+
+    // Each thread adds and removes its own residue class of keys, so it knows
+    // exactly what add and remove must return, while searching everyone's
+    // keys. Once the threads finish, the heights must have settled.
+    void testConcurrentAvl()
+    {
+        const int threads = 4, keys = 2000, steps = 50000;
+        for (int round = 0; round < 3; ++round)
+        {
+            concurrent_avl<int> t;
+            std::vector<std::set<int>> mine(threads);
+            std::vector<std::thread> workers;
+            for (int i = 0; i < threads; ++i)
+                workers.emplace_back([&, i]
+                {
+                    std::mt19937 rng(static_cast<unsigned>(round * threads + i));
+                    std::set<int>& m = mine[i];
+                    for (int j = 0; j < steps; ++j)
+                    {
+                        int k = static_cast<int>(rng() % keys) * threads + i;
+                        switch (rng() % 4)
+                        {
+                        case 0:
+                            CHECK(t.add(k) == m.insert(k).second);
+                            break;
+                        case 1:
+                            CHECK(t.remove(k) == (m.erase(k) > 0));
+                            break;
+                        default:
+                            CHECK(t.search(k) == (m.count(k) > 0));
+                            t.search(static_cast<int>(rng() % (keys * threads)));
+                        }
+                    }
+                });
+            for (std::thread& w : workers)
+                w.join();
+            CHECK(t.valid());
+            std::size_t total = 0;
+            for (const std::set<int>& m : mine)
+            {
+                total += m.size();
+                for (int k : m)
+                    CHECK(t.search(k));
+            }
+            CHECK(t.size() == total);
+        }
+    }
+
+    void makeKey(int i, int& k) { k = i; }
+    void makeKey(int i, std::string& k) { k = std::to_string(i); }
+
+    // The tree goes on being filled right after each background clear, while
+    // the reclaimer may still be freeing the old nodes.
+    template <typename Tree>
+    void fillWhileReclaiming()
+    {
+        typename Tree::value_type k;
+        background_reclaimer r;
+        Tree t;
+        for (int round = 0; round < 20; ++round)
+        {
+            for (int i = 0; i < 5000; ++i)
+            {
+                makeKey(round * 5000 + i, k);
+                t.insert(k);
+            }
+            t.clear(r);
+            CHECK(t.empty());
+        }
+        std::set<typename Tree::value_type> expected;
+        for (int i = 0; i < 5000; ++i)
+        {
+            makeKey(i, k);
+            t.insert(k);
+            expected.insert(k);
+        }
+        r.drain();
+        CHECK(t.size() == 5000 && std::equal(t.begin(), t.end(), expected.begin()));
+    }
+
+    // Strings keep a node_pool tree from releasing its pool wholesale; ints
+    // let clear() drop the pool at once while the same tree is refilled.
+    void testBackgroundClear()
+    {
+        using int_pool_tree = tree<int, std::less<>, node_pool<int>>;
+        fillWhileReclaiming<tree<std::string>>();
+        fillWhileReclaiming<tree<std::string, std::less<>, node_pool<std::string>>>();
+        fillWhileReclaiming<int_pool_tree>();
+
+        background_reclaimer r;
+        int_pool_tree t;
+        for (int i = 0; i < 5000; ++i)
+            t.insert(i);
+        t.clear(r);
+        CHECK(t.empty() && t.get_allocator().live() == 1);
+        t.insert(1);
+        CHECK(t.size() == 1 && t.get_allocator().live() == 2);
+    }
+
+    template <typename Set>
+    bool sameSharded(const sharded_tree<int>& t, const Set& s)
+    {
+        std::vector<int> seen;
+        t.for_each([&](int x) { seen.push_back(x); });
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < t.shard_count(); ++i)
+            n += t.shard_size(i);
+        return t.size() == s.size() && n == s.size() && std::equal(seen.begin(), seen.end(), s.begin(), s.end())
+            && std::equal(t.begin(), t.end(), s.begin(), s.end());
+    }
+
+    // The sharded trees live on the heap: libstdc++ does not destroy its
+    // pthread locks, so ThreadSanitizer would mistake the locks of a tree
+    // built later in the same stack slot for the old ones and report a
+    // lock-order inversion between the two.
+    void testShardedRouting()
+    {
+        std::unique_ptr<sharded_tree<int>> p(new sharded_tree<int>(4));
+        sharded_tree<int>& t = *p;
+        CHECK(t.empty() && t.begin() == t.end());
+        for (int i = 0; i < 3; ++i)
+            t.insert(7);
+        t.insert(3);
+        CHECK(t.shard_size(0) == 4 && t.count(7) == 3 && t.contains(3) && !t.contains(4));
+        CHECK(t.remove(7) == 3 && t.remove(7) == 0 && t.size() == 1);
+        t.clear();
+        CHECK(t.empty() && t.begin() == t.end());
+
+        // Fewer than resplitMinimum elements never re-split by themselves.
+        std::multiset<int> s;
+        for (int i = 1000; i > 0; --i)
+        {
+            t.insert(i % 500);
+            s.insert(i % 500);
+        }
+        CHECK(t.shard_size(0) == 1000 && sameSharded(t, s));
+
+        // Equal parts, each shard taking its own key range.
+        t.resplit();
+        for (std::size_t i = 0; i < 4; ++i)
+            CHECK(t.shard_size(i) == 250);
+        CHECK(sameSharded(t, s));
+        t.insert(0);
+        t.insert(499);
+        s.insert(0);
+        s.insert(499);
+        CHECK(t.shard_size(0) == 251 && t.shard_size(1) == 250 && t.shard_size(3) == 251);
+        for (std::size_t i = 0; i < s.size(); i += 37)
+            CHECK(t.at(i) == *std::next(s.begin(), static_cast<std::ptrdiff_t>(i)));
+        bool thrown = false;
+        try
+        {
+            t.at(s.size());
+        }
+        catch (const std::out_of_range&)
+        {
+            thrown = true;
+        }
+        CHECK(thrown);
+
+        // Emptying the middle shards leaves iteration to skip them.
+        for (int k = 125; k < 375; ++k)
+        {
+            t.remove(k);
+            s.erase(k);
+        }
+        CHECK(t.shard_size(1) == 0 && t.shard_size(2) == 0 && sameSharded(t, s));
+    }
+
+    // Ascending keys all land in the last shard, so the writers re-split the
+    // tree by themselves while a reader walks it.
+    void testShardedWriters()
+    {
+        const int threads = 4, perThread = 20000;
+        std::unique_ptr<sharded_tree<int>> p(new sharded_tree<int>(4));
+        sharded_tree<int>& t = *p;
+        std::atomic<bool> done{ false };
+        std::thread reader([&]
+        {
+            while (!done.load())
+            {
+                int last = -1;
+                bool sorted = true;
+                t.for_each([&](int x) { sorted = sorted && x >= last; last = x; });
+                CHECK(sorted);
+                std::size_t n = t.size();
+                if (n)
+                    t.contains(static_cast<int>(n / 2));
+            }
+        });
+        std::vector<std::thread> writers;
+        for (int w = 0; w < threads; ++w)
+            writers.emplace_back([&, w]
+            {
+                for (int i = 0; i < perThread; ++i)
+                {
+                    t.insert(i * threads + w);
+                    if (i % 10 == 9)
+                        CHECK(t.remove((i - 5) * threads + w) == 1);
+                }
+            });
+        for (std::thread& w : writers)
+            w.join();
+        done.store(true);
+        reader.join();
+
+        std::set<int> s;
+        for (int w = 0; w < threads; ++w)
+            for (int i = 0; i < perThread; ++i)
+                if (i % 10 != 4)
+                    s.insert(i * threads + w);
+        CHECK(sameSharded(t, s));
+        CHECK(t.shard_size(0) < t.size());
+        CHECK(t.at(0) == 0 && t.at(s.size() - 1) == *s.rbegin());
+    }
+}
+
+int main()
+{
+    testPersistentSnapshots();
+    testConcurrentAvl();
+    testBackgroundClear();
+    testShardedRouting();
+    testShardedWriters();
+    if (failures)
+        std::printf("%d checks failed\n", failures.load());
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,308 @@
+// Checks frozen_tree and its search indexes against std::lower_bound and
+// std::upper_bound over the same sorted keys.
+//
+// Each test prints nothing when it passes; a failed check prints its line and
+// makes the program exit with 1.
+#include "avl_tree.h"
+#include "avl_tree_with_iterators.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+    int failures = 0;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); ++failures; } } while (0)
+
+    // 0, 1, 2, 3 and 2^k - 1, 2^k, 2^k + 1: every shape of the last Eytzinger level.
+    std::vector<std::size_t> sizes()
+    {
+        std::vector<std::size_t> v = { 0, 1, 2, 3 };
+        for (std::size_t k = 2; k <= 13; ++k)
+            for (std::size_t n = (std::size_t(1) << k) - 1; n <= (std::size_t(1) << k) + 1; ++n)
+                v.push_back(n);
+        return v;
+    }
+
+    // n sorted ints from a range of about n / 2 values, so most keys repeat.
+    std::vector<int> sortedInts(std::size_t n, unsigned seed)
+    {
+        std::mt19937 rng(seed);
+        std::vector<int> v(n);
+        for (int& x : v)
+            x = static_cast<int>(rng() % (n / 2 + 1)) * 3 - static_cast<int>(n);
+        std::sort(v.begin(), v.end());
+        return v;
+    }
+
+    // Every key, its neighbours and keys past either end.
+    std::vector<int> probes(const std::vector<int>& keys)
+    {
+        std::vector<int> p = { -(1 << 30), 1 << 30 };
+        for (int k : keys)
+        {
+            p.push_back(k - 1);
+            p.push_back(k);
+            p.push_back(k + 1);
+        }
+        return p;
+    }
+
+    // rank(p) must be std::lower_bound's position, and rank(next(p)) std::upper_bound's.
+    template <typename T, typename Compare, typename Rank, typename Next>
+    bool ranksMatch(const std::vector<T>& keys, const std::vector<T>& probes, Compare comp, Rank rank, Next next)
+    {
+        for (const T& p : probes)
+        {
+            auto lo = std::lower_bound(keys.begin(), keys.end(), p, comp);
+            auto hi = std::upper_bound(keys.begin(), keys.end(), p, comp);
+            if (rank(p) != static_cast<std::size_t>(lo - keys.begin()) ||
+                rank(next(p)) != static_cast<std::size_t>(hi - keys.begin()))
+                return false;
+        }
+        return true;
+    }
+
+    // find, contains and the iterators agree with the sorted keys.
+    template <typename T, typename Compare>
+    bool frozenMatches(const frozen_tree<T, Compare>& f, const std::vector<T>& keys, const std::vector<T>& probes)
+    {
+        if (f.size() != keys.size() || f.empty() != keys.empty() || !std::equal(f.begin(), f.end(), keys.begin(), keys.end()))
+            return false;
+        Compare comp = f.key_comp();
+        for (const T& p : probes)
+        {
+            auto lo = std::lower_bound(keys.begin(), keys.end(), p, comp);
+            bool found = lo != keys.end() && !comp(p, *lo);
+            if (f.lower_bound(p) != f.begin() + (lo - keys.begin()) || f.contains(p) != found ||
+                f.find(p) != (found ? f.lower_bound(p) : f.end()))
+                return false;
+        }
+        return true;
+    }
+
+    // The Eytzinger index, searched directly and through frozen_tree, with
+    // duplicate keys and with a comparator other than std::less.
+    void testEytzinger()
+    {
+        auto plusOne = [](int x) { return x + 1; };
+        for (std::size_t n : sizes())
+        {
+            std::vector<int> keys = sortedInts(n, static_cast<unsigned>(n));
+            std::vector<int> ps = probes(keys);
+
+            eytzinger_index<int, std::less<>> e;
+            e.assign(n, [&](int* out) { std::copy(keys.begin(), keys.end(), out); });
+            CHECK(std::equal(keys.begin(), keys.end(), e.data()));
+            CHECK(ranksMatch(keys, ps, std::less<>(), [&](int p) { return e.lowerBound(p, n, std::less<>()); }, plusOne));
+
+            // std::greater has no packed index, so frozen_tree takes the Eytzinger one.
+            std::vector<int> down(keys.rbegin(), keys.rend());
+            frozen_tree<int, std::greater<>> g(down.begin(), down.end());
+            CHECK(ranksMatch(down, ps, std::greater<>(), [&](int p) { return g.rank(p); }, [](int x) { return x - 1; }));
+            CHECK(frozenMatches(g, down, ps));
+
+            // The smallest string greater than s is s followed by a null.
+            std::vector<std::string> words, wordProbes = { "", "~" };
+            for (int k : keys)
+                words.push_back(std::to_string(k));
+            std::sort(words.begin(), words.end());
+            for (const std::string& w : words)
+            {
+                wordProbes.push_back(w);
+                wordProbes.push_back(w + "5");
+                wordProbes.push_back(w.substr(0, w.size() - 1));
+            }
+            frozen_tree<std::string> s(words.begin(), words.end());
+            CHECK(ranksMatch(words, wordProbes, std::less<>(), [&](const std::string& p) { return s.rank(p); },
+                [](const std::string& p) { return p + '\0'; }));
+            CHECK(frozenMatches(s, words, wordProbes));
+        }
+    }
+
+    // Keys of the packed B+ tree index: sorted, mostly repeated, and with the
+    // type's extremes in the second half of the sizes. The extremes include the
+    // value used to pad the last leaf and the unused separators.
+    template <typename T>
+    std::vector<T> packedKeys(std::size_t n, bool extremes)
+    {
+        using limits = std::numeric_limits<T>;
+        std::mt19937 rng(static_cast<unsigned>(n));
+        std::size_t range = std::min<std::size_t>(n / 2 + 1, 10000);
+        std::vector<T> v(n);
+        for (T& x : v)
+        {
+            long long k = static_cast<long long>(rng() % range) * 3 - (limits::is_signed ? 10000 : 0);
+            x = limits::is_integer ? static_cast<T>(k) : static_cast<T>(k / 2.0);
+        }
+        if (extremes && n >= 4)
+        {
+            v[0] = v[1] = limits::has_infinity ? -limits::infinity() : limits::lowest();
+            v[n - 1] = v[n - 2] = limits::has_infinity ? limits::infinity() : limits::max();
+            if (limits::has_infinity)
+                v[2] = limits::max();
+        }
+        std::sort(v.begin(), v.end());
+        return v;
+    }
+
+    // The next representable value above x; x must not be the largest.
+    template <typename T>
+    T above(T x)
+    {
+        if constexpr (std::numeric_limits<T>::is_integer)
+            return static_cast<T>(x + 1);
+        else
+            return std::nextafter(x, std::numeric_limits<T>::infinity());
+    }
+    template <typename T>
+    T below(T x)
+    {
+        if constexpr (std::numeric_limits<T>::is_integer)
+            return static_cast<T>(x - 1);
+        else
+            return std::nextafter(x, -std::numeric_limits<T>::infinity());
+    }
+
+    // Sizes that fill whole leaves or spill into one more, for one to three
+    // inner levels, on top of the Eytzinger sizes.
+    template <typename T>
+    std::vector<std::size_t> packedSizes()
+    {
+        const std::size_t B = 64 / sizeof(T);
+        std::vector<std::size_t> v = sizes();
+        for (std::size_t m = B; m <= B * (B + 1) * (B + 1); m *= B + 1)
+            for (std::size_t n = m - 1; n <= m + 1; ++n)
+                v.push_back(n);
+        return v;
+    }
+
+    template <typename T, typename Compare = std::less<>>
+    void checkPacked()
+    {
+        using limits = std::numeric_limits<T>;
+        const T top = limits::has_infinity ? limits::infinity() : limits::max();
+        const T bottom = limits::has_infinity ? -limits::infinity() : limits::lowest();
+        for (std::size_t n : packedSizes<T>())
+            for (bool extremes : { false, true })
+            {
+                std::vector<T> keys = packedKeys<T>(n, extremes);
+                std::vector<T> ps = { bottom, top, limits::lowest(), limits::max() };
+                for (T k : keys)
+                {
+                    ps.push_back(k);
+                    if (k != bottom)
+                        ps.push_back(below(k));
+                    if (k != top)
+                        ps.push_back(above(k));
+                }
+                frozen_tree<T, Compare> f(keys.begin(), keys.end());
+                CHECK(frozenMatches(f, keys, ps));
+                bool ok = true;
+                for (T p : ps)
+                {
+                    std::size_t lo = static_cast<std::size_t>(std::lower_bound(keys.begin(), keys.end(), p) - keys.begin());
+                    std::size_t hi = static_cast<std::size_t>(std::upper_bound(keys.begin(), keys.end(), p) - keys.begin());
+                    ok = ok && f.rank(p) == lo && (p == top || f.rank(above(p)) == hi);
+                }
+                CHECK(ok);
+            }
+    }
+
+    // The packed index of every arithmetic key type: the SIMD count for the
+    // types the build has instructions for, the plain loop for the others.
+    void testPacked()
+    {
+        checkPacked<int>();
+        checkPacked<std::int64_t>();
+        checkPacked<unsigned>();
+        checkPacked<short>();
+        checkPacked<float>();
+        checkPacked<double, std::less<double>>();
+
+        // Keys of another type are searched as that type, past the index.
+        std::vector<int> keys = packedKeys<int>(1000, true);
+        frozen_tree<int> f(keys.begin(), keys.end());
+        bool ok = true;
+        for (long long p : { -20000LL, -1LL, 0LL, 7LL, 1LL << 40 })
+            ok = ok && f.rank(p) == static_cast<std::size_t>(std::lower_bound(keys.begin(), keys.end(), p) - keys.begin());
+        CHECK(ok);
+    }
+
+    // freeze(f) refreshes a snapshot as the tree changes, reusing its storage
+    // when the size has not changed.
+    void testRefresh()
+    {
+        std::mt19937 rng(11);
+        tree<std::string> t;
+        avl<int> a;
+        frozen_tree<std::string> f;
+        frozen_tree<int> g;
+        std::vector<int> keys;
+        for (int round = 0; round < 20; ++round)
+        {
+            for (int i = 0; i < 200; ++i)
+            {
+                int k = static_cast<int>(rng() % 1000);
+                if (rng() % 3)
+                {
+                    t.insert(std::to_string(k));
+                    a.add(k);
+                }
+                else
+                {
+                    t.remove(std::to_string(k));
+                    a.remove(k);
+                }
+            }
+            t.freeze(f);
+            a.freeze(g);
+            std::vector<std::string> words(t.begin(), t.end());
+            keys.assign(a.begin(), a.end());
+            CHECK(frozenMatches(f, words, words));
+            CHECK(frozenMatches(g, keys, probes(keys)));
+        }
+
+        const std::string* before = f.begin();
+        t.erase(t.begin());
+        t.insert("x");
+        t.freeze(f);
+        CHECK(f.begin() == before && f.size() == t.size() && f.contains("x"));
+        CHECK(std::equal(f.begin(), f.end(), t.begin(), t.end()));
+    }
+}
+
+// A build for instructions this machine lacks cannot run; CTest counts the
+// exit code 77 as skipped.
+bool cpuLacksBuildTarget()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#if defined(__AVX2__)
+    return !__builtin_cpu_supports("avx2");
+#elif defined(__SSE4_2__)
+    return !__builtin_cpu_supports("sse4.2");
+#endif
+#endif
+    return false;
+}
+
+int main()
+{
+    if (cpuLacksBuildTarget())
+        return 77;
+    testEytzinger();
+    testPacked();
+    testRefresh();
+    if (failures)
+        std::printf("%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}
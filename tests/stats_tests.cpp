@@ -0,0 +1,105 @@
+// Checks the operation counters of tree_stats.h, built with AVL_TREE_STATS.
+//
+// Each test prints nothing when it passes; a failed check prints its line and
+// makes the program exit with 1.
+#ifndef AVL_TREE_STATS
+#define AVL_TREE_STATS
+#endif
+#include "avl_tree.h"
+#include "avl_tree_with_iterators.h"
+
+#include <cstdio>
+#include <vector>
+
+namespace
+{
+    int failures = 0;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); ++failures; } } while (0)
+
+    // Every way of adding or removing elements counts each element once.
+    template <typename Alloc>
+    void checkTreeCounts()
+    {
+        tree<int, std::less<>, Alloc> t;
+        for (int i = 0; i < 100; ++i)
+            t.insert(i);
+        CHECK(t.stats().inserts == 100);
+        t.insert(t.cend(), 100);
+        t.emplace(101);
+
+        std::vector<int> v;
+        for (int i = 0; i < 50; ++i)
+            v.push_back(200 - i);
+        t.insert_batch(v.begin(), v.end());
+        CHECK(t.stats().inserts == 152);
+
+        // The same allocator relinks the nodes, another one copies the elements.
+        tree<int, std::less<>, Alloc> same(t.get_allocator()), other;
+        for (int i = 0; i < 30; ++i)
+        {
+            same.insert(300 + i);
+            other.insert(400 + i);
+        }
+        t.merge(same);
+        t.merge(other);
+        tree_stats s = t.stats();
+        CHECK(s.inserts == 212 && t.size() == 212 && s.erases == 0);
+        CHECK(s.insertRotations > 0 && s.insertRetraceSteps >= 102);
+
+        t.erase(t.begin());
+        t.erase(t.find(50), t.find(60));
+        t.erase(t.find(60), t.find(90));
+        CHECK(t.remove(95) == 1 && t.remove(1000) == 0);
+        CHECK(t.erase_range(300, 310) == 10);
+        s = t.stats();
+        CHECK(s.erases == 52 && t.size() == 160);
+
+        CHECK(t.contains(7) && t.find(-1) == t.end());
+        CHECK(t.stats().finds >= 2 && t.stats().findComparisons > 0);
+
+        t.reset_stats();
+        s = t.stats();
+        CHECK(s.inserts == 0 && s.erases == 0 && s.finds == 0 && s.findComparisons == 0);
+        CHECK(s.insertRotations == 0 && s.insertRetraceSteps == 0 && s.size == 160);
+    }
+
+    void testTreeCounters()
+    {
+        checkTreeCounts<std::allocator<int>>();
+        checkTreeCounts<node_pool<int>>();
+    }
+
+    void testAvlCounters()
+    {
+        avl<int> a;
+        for (int i = 0; i < 1000; ++i)
+            a.add(i);
+        tree_stats s = a.stats();
+        CHECK(s.inserts == 1000 && s.insertRotations > 0 && s.insertRetraceSteps >= 1000);
+
+        for (int i = 0; i < 1000; i += 2)
+            a.remove(i);
+        a.remove(-1);
+        s = a.stats();
+        CHECK(s.erases == 500 && s.eraseRetraceSteps > 0 && s.size == 500);
+
+        CHECK(a.search(1) && !a.search(2));
+        s = a.stats();
+        CHECK(s.finds == 2 && s.findComparisons > 0);
+
+        a.reset_stats();
+        s = a.stats();
+        CHECK(s.inserts == 0 && s.erases == 0 && s.finds == 0 && s.eraseRotations == 0 && s.size == 500);
+    }
+}
+
+int main()
+{
+    testTreeCounters();
+    testAvlCounters();
+    if (failures)
+        std::printf("%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,759 @@
+// Checks the containers against std::multiset on random operations.
+//
+// Each test prints nothing when it passes; a failed check prints its line and
+// makes the program exit with 1.
+#include "avl_tree.h"
+#include "avl_tree_with_iterators.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace
+{
+    int failures = 0;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); ++failures; } } while (0)
+
+    // An AVL tree of n elements is at most 1.44 log2(n + 2) high.
+    bool balanced(std::size_t n, std::size_t height) { return height <= 1.4405 * std::log2(n + 2.0); }
+
+    template <typename Tree, typename Set>
+    bool same(const Tree& t, const Set& s)
+    {
+        if (t.size() != s.size())
+            return false;
+        auto it = t.cbegin();
+        for (const auto& x : s)
+        {
+            if (it == t.cend() || !(*it == x))
+                return false;
+            ++it;
+        }
+        if (it != t.cend())
+            return false;
+        for (std::size_t i = 0; i < s.size(); i += 1 + s.size() / 16)
+            if (!(t[i] == *std::next(s.begin(), static_cast<std::ptrdiff_t>(i))))
+                return false;
+        return balanced(t.size(), t.stats().height);
+    }
+
+    // lower_bound, upper_bound and equal_range of t, mutable and const, at the
+    // positions std::lower_bound and std::upper_bound give in sorted v.
+    template <typename K>
+    bool boundsMatch(tree<int>& t, const std::vector<int>& v, K k)
+    {
+        std::size_t lo = static_cast<std::size_t>(std::lower_bound(v.begin(), v.end(), k, std::less<>()) - v.begin());
+        std::size_t hi = static_cast<std::size_t>(std::upper_bound(v.begin(), v.end(), k, std::less<>()) - v.begin());
+        const tree<int>& c = t;
+        auto r = t.equal_range(k);
+        auto cr = c.equal_range(k);
+        return t.rank(t.lower_bound(k)) == lo && t.rank(t.upper_bound(k)) == hi && t.rank(c.upper_bound(k)) == hi &&
+            t.rank(r.first) == lo && t.rank(r.second) == hi && t.rank(cr.first) == lo && t.rank(cr.second) == hi;
+    }
+
+    void testInsertErase()
+    {
+        std::mt19937 rng(1);
+        tree<int> t;
+        std::multiset<int> s;
+        for (int i = 0; i < 20000; ++i)
+        {
+            int k = static_cast<int>(rng() % 2000);
+            if (rng() % 3)
+            {
+                t.insert(k);
+                s.insert(k);
+            }
+            else
+            {
+                auto it = t.find(k);
+                CHECK((it != t.end()) == (s.count(k) > 0));
+                if (it != t.end())
+                {
+                    t.erase(it);
+                    s.erase(s.find(k));
+                }
+            }
+        }
+        CHECK(same(t, s));
+        for (int k = 0; k < 2000; k += 7)
+        {
+            CHECK(t.count(k) == s.count(k));
+            CHECK(t.rank(k) == static_cast<std::size_t>(std::distance(s.begin(), s.lower_bound(k))));
+        }
+
+        // Every key, so runs of duplicates, gaps and keys past either end.
+        std::vector<int> v(s.begin(), s.end());
+        bool ok = true;
+        for (int k = -3; k <= 2003; ++k)
+            ok = ok && boundsMatch(t, v, k);
+        for (long long k : { -(1LL << 40), -1LL, 0LL, 1000LL, 1999LL, 2000LL, 1LL << 40 })
+            ok = ok && boundsMatch(t, v, k);
+        CHECK(ok);
+        CHECK(t.upper_bound(v.back()) == t.end() && t.equal_range(-1).first == t.begin() && t.equal_range(-1).second == t.begin());
+    }
+
+    void testSplitJoin()
+    {
+        tree<int> t;
+        for (int i = 0; i < 1000; ++i)
+            t.insert(i);
+        tree<int> r = t.split(400);
+        CHECK(t.size() == 400 && r.size() == 600);
+        CHECK(t.back() == 399 && r.front() == 400);
+        tree<int> j = tree<int>::join(std::move(t), std::move(r));
+        std::multiset<int> s;
+        for (int i = 0; i < 1000; ++i)
+            s.insert(i);
+        CHECK(same(j, s));
+    }
+
+    void testBatches()
+    {
+        std::mt19937 rng(2);
+        tree<int> t;
+        std::multiset<int> s;
+        for (int round = 0; round < 20; ++round)
+        {
+            std::vector<int> v(500);
+            for (int& x : v)
+                x = static_cast<int>(rng() % 5000);
+            t.insert_batch(v.begin(), v.end());
+            s.insert(v.begin(), v.end());
+        }
+        CHECK(same(t, s));
+        std::vector<int> keys = { 0, 17, 4999, 5000, -1, 2500 };
+        std::vector<tree<int>::iterator> found;
+        t.find_batch(keys.begin(), keys.end(), std::back_inserter(found));
+        for (std::size_t i = 0; i < keys.size(); ++i)
+            CHECK((found[i] != t.end()) == (s.count(keys[i]) > 0));
+    }
+
+    void testMergeExtract()
+    {
+        tree<int> a, b;
+        std::multiset<int> s;
+        for (int i = 0; i < 3000; ++i)
+        {
+            (i % 2 ? a : b).insert(i % 1000);
+            s.insert(i % 1000);
+        }
+        a.merge(b);
+        CHECK(b.empty());
+        CHECK(same(a, s));
+        auto h = a.extract(500);
+        CHECK(!h.empty() && h.value() == 500);
+        s.erase(s.find(500));
+        CHECK(same(a, s));
+        b.insert(std::move(h));
+        CHECK(b.size() == 1 && b.front() == 500);
+    }
+
+    void testEraseRanges()
+    {
+        tree<int> t;
+        std::multiset<int> s;
+        for (int i = 0; i < 5000; ++i)
+        {
+            t.insert(i % 2500);
+            s.insert(i % 2500);
+        }
+        CHECK(t.erase_range(100, 2000) == 2 * 1900);
+        s.erase(s.lower_bound(100), s.lower_bound(2000));
+        CHECK(same(t, s));
+        tree<int> x = t.extract_range(2100, 2110);
+        CHECK(x.size() == 20);
+        s.erase(s.lower_bound(2100), s.lower_bound(2110));
+        CHECK(same(t, s));
+        t.erase(t.begin(), t.lower_bound(50));
+        s.erase(s.begin(), s.lower_bound(50));
+        CHECK(same(t, s));
+    }
+
+    // Elements compared by key only, so equal keys keep their insertion order.
+    struct entry
+    {
+        int key;
+        int seq;
+        bool operator== (const entry& e) const { return key == e.key && seq == e.seq; }
+    };
+    struct entryLess
+    {
+        bool operator() (const entry& a, const entry& b) const { return a.key < b.key; }
+    };
+
+    void testHintedInsert()
+    {
+        std::mt19937 rng(3);
+        tree<entry, entryLess> t;
+        std::multiset<entry, entryLess> s;
+        for (int i = 0; i < 5000; ++i)
+        {
+            entry e = { static_cast<int>(rng() % 300), i };
+            std::size_t pos = rng() % (t.size() + 1);
+            tree<entry, entryLess>::const_iterator hint = pos == t.size() ? t.cend() : t.at(pos);
+            auto it = i % 2 ? t.insert(hint, e) : t.emplace_hint(hint, e);
+            CHECK(it->seq == i);
+            s.insert(e);
+            if (i % 5 == 0)
+            {
+                t.erase(t.find(e));
+                s.erase(s.find(e));
+            }
+        }
+        CHECK(same(t, s));
+
+        tree<int> a;
+        auto hint = a.cend();
+        for (int i = 0; i < 10000; ++i)
+            hint = a.insert(hint, i);
+        CHECK(a.size() == 10000 && a.back() == 9999 && balanced(a.size(), a.stats().height));
+    }
+
+    void testSetOperations()
+    {
+        tree<int> a, b;
+        for (int i = 0; i < 1000; ++i)
+        {
+            a.insert(i);
+            b.insert(i + 500);
+        }
+        tree<int> u(a), d(a);
+        u.unite(b);
+        CHECK(u.size() == 1500 && u.front() == 0 && u.back() == 1499);
+        a.intersect(b);
+        CHECK(a.size() == 500 && a.front() == 500 && a.back() == 999);
+        d.subtract(b);
+        CHECK(d.size() == 500 && d.back() == 499);
+    }
+
+    // Sum plus a polynomial hash of the elements in order, so an aggregate
+    // combined out of order, or left stale in some node, does not match.
+    struct ordered_hash
+    {
+        struct value_type
+        {
+            long long sum;
+            std::uint64_t hash, power;
+            bool operator== (const value_type& v) const { return sum == v.sum && hash == v.hash && power == v.power; }
+        };
+        static value_type identity() { return { 0, 0, 1 }; }
+        static value_type lift(int x) { return { x, static_cast<std::uint64_t>(x) + 1, 1000003 }; }
+        static value_type combine(const value_type& a, const value_type& b)
+        {
+            return { a.sum + b.sum, a.hash * b.power + b.hash, a.power * b.power };
+        }
+    };
+    using hashed_tree = tree<int, std::less<>, std::allocator<int>, ordered_hash>;
+
+    // The aggregate of t over [lo, hi) and of all of t, against folding the
+    // same elements of s one by one.
+    bool aggregatesMatch(const hashed_tree& t, const std::multiset<int>& s, std::mt19937& rng)
+    {
+        auto fold = [&](int lo, int hi)
+        {
+            ordered_hash::value_type v = ordered_hash::identity();
+            for (auto it = s.lower_bound(lo); it != s.end() && *it < hi; ++it)
+                v = ordered_hash::combine(v, ordered_hash::lift(*it));
+            return v;
+        };
+        if (!(t.aggregate() == fold(-1, 1 << 30)) || !(t.aggregate(5, 5) == ordered_hash::identity()))
+            return false;
+        for (int i = 0; i < 20; ++i)
+        {
+            int lo = static_cast<int>(rng() % 2100) - 50, hi = lo + static_cast<int>(rng() % 600);
+            if (!(t.aggregate(lo, hi) == fold(lo, hi)))
+                return false;
+        }
+        return true;
+    }
+
+    // Every operation that restructures the tree keeps the aggregates current.
+    void testAggregates()
+    {
+        std::mt19937 rng(5);
+        hashed_tree t;
+        std::multiset<int> s;
+        auto key = [&] { return static_cast<int>(rng() % 2000); };
+        for (int round = 0; round < 300; ++round)
+        {
+            int a = key(), b = key();
+            int lo = std::min(a, b), hi = std::max(a, b);
+            switch (round % 9)
+            {
+            case 0:
+                for (int i = 0; i < 100; ++i)
+                {
+                    int k = key();
+                    t.insert(k);
+                    s.insert(k);
+                }
+                break;
+            case 1:
+                for (int i = 0; i < 50; ++i)
+                {
+                    auto it = t.find(key());
+                    if (it != t.end())
+                    {
+                        s.erase(s.find(*it));
+                        t.erase(it);
+                    }
+                }
+                break;
+            case 2:
+            {
+                std::vector<int> v(200);
+                for (int& x : v)
+                    x = key();
+                t.insert_batch(v.begin(), v.end());
+                s.insert(v.begin(), v.end());
+                break;
+            }
+            case 3:
+                t.erase_range(lo, hi);
+                s.erase(s.lower_bound(lo), s.lower_bound(hi));
+                break;
+            case 4:
+            {
+                hashed_tree r = t.split(a);
+                std::multiset<int> sr(s.lower_bound(a), s.end());
+                s.erase(s.lower_bound(a), s.end());
+                CHECK(aggregatesMatch(t, s, rng) && aggregatesMatch(r, sr, rng));
+                t = hashed_tree::join(std::move(t), std::move(r));
+                s.insert(sr.begin(), sr.end());
+                break;
+            }
+            case 5:
+            {
+                hashed_tree x = t.extract_range(lo, hi);
+                std::multiset<int> sx(s.lower_bound(lo), s.lower_bound(hi));
+                s.erase(s.lower_bound(lo), s.lower_bound(hi));
+                CHECK(aggregatesMatch(x, sx, rng));
+                t.merge(x);
+                s.insert(sx.begin(), sx.end());
+                break;
+            }
+            case 6:
+            {
+                hashed_tree u;
+                for (int i = 0; i < 100; ++i)
+                {
+                    int k = key();
+                    u.insert(k);
+                    s.insert(k);
+                }
+                t.merge(u);
+                break;
+            }
+            case 7:
+            {
+                // join with a pivot, as the set operations do
+                hashed_tree r = t.split(a);
+                t = hashed_tree::join(std::move(t), a, std::move(r));
+                s.insert(a);
+                break;
+            }
+            case 8:
+                t.assign_sorted(s.begin(), s.end());
+                break;
+            }
+            CHECK(aggregatesMatch(t, s, rng));
+        }
+        CHECK(same(t, s));
+
+        tree<int, std::less<>, std::allocator<int>, min_augment<int>> mn;
+        tree<int, std::less<>, std::allocator<int>, max_augment<int>> mx;
+        for (int x : s)
+        {
+            mn.insert(x);
+            mx.insert(x);
+        }
+        CHECK(mn.aggregate() == *s.begin() && mx.aggregate() == *s.rbegin());
+        CHECK(mn.aggregate(500, 600) == *s.lower_bound(500) && mx.aggregate(500, 600) == *std::prev(s.lower_bound(600)));
+    }
+
+    // assign and assign_sorted above the parallel cutoff: the chunked stable
+    // sort keeps equal keys in input order and the threads' subtrees link
+    // into one balanced tree with its counts and aggregates filled in.
+    void testParallelBuild()
+    {
+        std::mt19937 rng(5);
+        for (int n : { 1 << 14, 50001 })
+        {
+            std::vector<entry> v(static_cast<std::size_t>(n));
+            for (int i = 0; i < n; ++i)
+                v[static_cast<std::size_t>(i)] = { static_cast<int>(rng() % 2000), i };
+            std::multiset<entry, entryLess> s(v.begin(), v.end());
+            std::vector<int> sorted;
+            for (const entry& e : s)
+                sorted.push_back(e.key);
+            std::multiset<int> keys(sorted.begin(), sorted.end());
+
+            for (unsigned threads : { 2u, 3u, 8u })
+            {
+                tree<entry, entryLess> t;
+                t.insert({ -1, -1 });
+                t.assign(v.begin(), v.end(), threads);
+                CHECK(same(t, s));
+                CHECK(std::equal(std::make_reverse_iterator(t.cend()), std::make_reverse_iterator(t.cbegin()), s.rbegin(), s.rend()));
+
+                hashed_tree h;
+                h.assign_sorted(sorted.begin(), sorted.end(), threads);
+                CHECK(same(h, keys) && aggregatesMatch(h, keys, rng));
+                for (int i = 0; i < 200; ++i)
+                {
+                    int k = static_cast<int>(rng() % 2000);
+                    if (i % 2)
+                    {
+                        h.insert(k);
+                        keys.insert(k);
+                    }
+                    else
+                        CHECK(h.remove(k) == keys.erase(k));
+                }
+                CHECK(same(h, keys) && aggregatesMatch(h, keys, rng));
+                keys.clear();
+                keys.insert(sorted.begin(), sorted.end());
+            }
+        }
+    }
+
+    // unite, intersect and subtract forked across threads, against the std
+    // algorithms on sets of keys, and on multisets against what each keeps:
+    // every element of this tree, then one per key, then none of t's keys.
+    void testParallelSetOperations()
+    {
+        std::mt19937 rng(6);
+        for (std::size_t nb : { 40000, 300 })
+            for (unsigned threads : { 2u, 3u, 8u })
+            {
+                std::set<int> sa, sb;
+                while (sa.size() < 50000)
+                    sa.insert(static_cast<int>(rng() % 150000));
+                while (sb.size() < nb)
+                    sb.insert(static_cast<int>(rng() % 150000));
+                std::vector<int> u, i, d;
+                std::set_union(sa.begin(), sa.end(), sb.begin(), sb.end(), std::back_inserter(u));
+                std::set_intersection(sa.begin(), sa.end(), sb.begin(), sb.end(), std::back_inserter(i));
+                std::set_difference(sa.begin(), sa.end(), sb.begin(), sb.end(), std::back_inserter(d));
+
+                hashed_tree a(sa.begin(), sa.end()), b(sb.begin(), sb.end());
+                hashed_tree tu(a), ti(a), td(a);
+                tu.unite(b, threads);
+                ti.intersect(hashed_tree(b), threads);
+                td.subtract(b, threads);
+                std::multiset<int> mu(u.begin(), u.end()), mi(i.begin(), i.end()), md(d.begin(), d.end());
+                CHECK(same(tu, mu) && aggregatesMatch(tu, mu, rng));
+                CHECK(same(ti, mi) && aggregatesMatch(ti, mi, rng));
+                CHECK(same(td, md) && aggregatesMatch(td, md, rng));
+                CHECK(b.size() == sb.size());
+
+                std::multiset<int> ma, mb;
+                for (std::size_t k = 0; k < 40000; ++k)
+                    ma.insert(static_cast<int>(rng() % 5000));
+                for (std::size_t k = 0; k < nb / 2; ++k)
+                    mb.insert(static_cast<int>(rng() % 5000));
+                std::multiset<int> eu(ma), ei, ed;
+                for (int x : mb)
+                    if (!ma.count(x))
+                        eu.insert(x);
+                for (int x : ma)
+                {
+                    if (mb.count(x) && !ei.count(x))
+                        ei.insert(x);
+                    if (!mb.count(x))
+                        ed.insert(x);
+                }
+                tree<int> du(ma.begin(), ma.end()), di(du), dd(du);
+                du.unite(tree<int>(mb.begin(), mb.end()), threads);
+                di.intersect(tree<int>(mb.begin(), mb.end()), threads);
+                dd.subtract(tree<int>(mb.begin(), mb.end()), threads);
+                CHECK(same(du, eu) && same(di, ei) && same(dd, ed));
+            }
+    }
+
+    // Augment values that count themselves, to see whether nodes are destroyed.
+    struct tracked
+    {
+        inline static int live = 0;
+        int v = 0;
+        tracked(int v = 0) : v(v) { ++live; }
+        tracked(const tracked& t) : v(t.v) { ++live; }
+        tracked& operator= (const tracked&) = default;
+        ~tracked() { --live; }
+    };
+    struct tracked_sum
+    {
+        using value_type = tracked;
+        static tracked identity() { return tracked(); }
+        static tracked lift(int x) { return tracked(x); }
+        static tracked combine(const tracked& a, const tracked& b) { return tracked(a.v + b.v); }
+    };
+
+    // clear() drops a node_pool wholesale only when the slots hold this tree's
+    // nodes and nothing else.
+    void testNodePoolClear()
+    {
+        using pool_tree = tree<int, std::less<>, node_pool<int>>;
+        {
+            node_pool<int> pool;
+            pool_tree t(pool);
+            for (int i = 0; i < 1000; ++i)
+                t.insert(i);
+            t.clear();
+            CHECK(t.empty() && pool.live() == 1);
+            for (int i = 0; i < 10; ++i)
+                t.insert(i);
+            CHECK(t.size() == 10 && t.back() == 9 && pool.live() == 11);
+        }
+        {
+            // The list's nodes fix the slot size, so the tree's come from the heap.
+            node_pool<int> pool;
+            std::list<int, node_pool<int>> l({ 1, 2, 3, 4 }, pool);
+            {
+                pool_tree t(pool);
+                for (int i = 0; i < 3; ++i)
+                    t.insert(i);
+                CHECK(pool.live() == 4);
+                t.clear();
+                CHECK(t.empty() && pool.live() == 4);
+                l.push_back(5);
+            }
+            int sum = 0;
+            for (int x : l)
+                sum += x;
+            CHECK(l.size() == 5 && sum == 15 && pool.live() == 5);
+        }
+        {
+            tree<int, std::less<>, node_pool<int>, tracked_sum> t;
+            for (int i = 0; i < 100; ++i)
+                t.insert(i);
+            CHECK(t.aggregate().v == 4950);
+            t.clear();
+            CHECK(t.empty() && tracked::live == 1);
+        }
+        CHECK(tracked::live == 0);
+    }
+
+    // Adding an element of the tree itself must copy it before the node vector grows.
+    void testAvlAddOwnElement()
+    {
+        avl<std::string> a;
+        a.add(std::string(40, 'x'));
+        for (int i = 0; i < 40; ++i)
+            a.add(*a.begin());
+        std::size_t n = 0;
+        for (const std::string& x : a)
+        {
+            CHECK(x == std::string(40, 'x'));
+            ++n;
+        }
+        CHECK(n == 41 && a.size() == 41);
+    }
+
+    void testAvlAssignSorted()
+    {
+        avl<int> a;
+        for (int i = 0; i < 100; ++i)
+            a.add(i * 3);
+        std::vector<int> v;
+        for (int i = 0; i < 1000; ++i)
+            v.push_back(i);
+        a.assign_sorted(v.begin(), v.end());
+        CHECK(a.size() == 1000 && a.search(999) && !a.search(1000) && !a.search(-3));
+        CHECK(balanced(a.size(), a.stats().height));
+        a.add(1000);
+        a.remove(0);
+        CHECK(a.size() == 1000 && *a.begin() == 1 && a.search(1000));
+    }
+
+    // A plain binary search tree. Inserting a pre-order walk rebuilds the
+    // tree it came from, so it serves as the reference for the other orders.
+    struct shape
+    {
+        struct node { int key; int left = -1, right = -1; };
+        std::vector<node> nodes;
+
+        void insert(int key)
+        {
+            int* at = nullptr;
+            for (int i = nodes.empty() ? -1 : 0; i != -1; i = *at)
+                at = key < nodes[i].key ? &nodes[i].left : &nodes[i].right;
+            if (at)
+                *at = static_cast<int>(nodes.size());
+            nodes.push_back({ key });
+        }
+        void walk(int i, std::vector<int>& pre, std::vector<int>& post) const
+        {
+            if (i == -1)
+                return;
+            pre.push_back(nodes[i].key);
+            walk(nodes[i].left, pre, post);
+            walk(nodes[i].right, pre, post);
+            post.push_back(nodes[i].key);
+        }
+    };
+
+    template <typename V>
+    std::vector<int> collect(const V& v) { return std::vector<int>(v.begin(), v.end()); }
+
+    // The first n elements f saw, stopping it there.
+    template <typename Visit>
+    std::vector<int> visitFirst(std::size_t n, bool& finished, Visit visit)
+    {
+        std::vector<int> seen;
+        finished = visit([&](int x)
+        {
+            if (seen.size() == n)
+                return false;
+            seen.push_back(x);
+            return true;
+        });
+        return seen;
+    }
+
+    // The pre-order, post-order and in-order walks, their views and visitors,
+    // and visitRange, as the tree grows and shrinks.
+    void testAvlTraversals()
+    {
+        std::mt19937 rng(19);
+        avl<int> a;
+        std::set<int> s;
+        for (int round = 0; round < 400; ++round)
+        {
+            int k = static_cast<int>(rng() % 300);
+            if (s.count(k))
+            {
+                a.remove(k);
+                s.erase(k);
+            }
+            else
+            {
+                a.add(k);
+                s.insert(k);
+            }
+
+            std::vector<int> in = collect(a.inOrderView()), pre = collect(a.preOrderView()), post = collect(a.postOrderView());
+            CHECK(in == std::vector<int>(s.begin(), s.end()));
+            shape ref;
+            for (int x : pre)
+                ref.insert(x);
+            std::vector<int> refPre, refPost;
+            ref.walk(ref.nodes.empty() ? -1 : 0, refPre, refPost);
+            CHECK(pre == refPre && post == refPost);
+            CHECK(a.preOrderView().empty() == s.empty() && a.postOrderView().empty() == s.empty());
+
+            // The postfix increment returns the element it stepped past.
+            auto it = a.preOrderView().begin();
+            if (!s.empty())
+                CHECK(*it++ == pre[0] && (pre.size() == 1 ? it == a.preOrderView().end() : *it == pre[1]));
+
+            // A visitor returning false stops the walk on the element it refused.
+            std::size_t n = rng() % (s.size() + 2);
+            bool finished;
+            std::size_t stop = std::min(n, s.size());
+            CHECK(visitFirst(n, finished, [&](auto f) { return a.visitInOrder(f); }) == std::vector<int>(in.begin(), in.begin() + stop) && finished == (n >= s.size()));
+            CHECK(visitFirst(n, finished, [&](auto f) { return a.visitPreOrder(f); }) == std::vector<int>(pre.begin(), pre.begin() + stop) && finished == (n >= s.size()));
+            CHECK(visitFirst(n, finished, [&](auto f) { return a.visitPostOrder(f); }) == std::vector<int>(post.begin(), post.begin() + stop) && finished == (n >= s.size()));
+
+            // Bounds on, between and past the keys, in both orders.
+            int lo = static_cast<int>(rng() % 320) - 10, hi = static_cast<int>(rng() % 320) - 10;
+            std::vector<int> expect(s.lower_bound(lo), lo < hi ? s.lower_bound(hi) : s.lower_bound(lo));
+            std::vector<int> seen;
+            CHECK(a.visitRange(lo, hi, [&](int x) { seen.push_back(x); }) && seen == expect);
+            CHECK(collect(a.range(lo, hi)) == expect);
+            std::vector<int> firstTwo = visitFirst(2, finished, [&](auto f) { return a.visitRange(lo, hi, f); });
+            CHECK(firstTwo == std::vector<int>(expect.begin(), expect.begin() + std::min<std::size_t>(2, expect.size())) && finished == (expect.size() <= 2));
+        }
+    }
+
+    bool opens(const std::string& path)
+    {
+        try
+        {
+            mapped_tree<int> m(path);
+            return true;
+        }
+        catch (const std::runtime_error&)
+        {
+            return false;
+        }
+    }
+
+    void testMappedTree()
+    {
+        const std::string path = "tree_tests_mapped.bin";
+        tree<int> t;
+        for (int i = 0; i < 1000; ++i)
+            t.insert(2 * i);
+        t.save(path);
+        mapped_tree<int> m(path);
+        CHECK(m.size() == 1000 && m.contains(1998) && !m.contains(1) && m.rank(11) == 6);
+        CHECK(tree<int>::load(path) == t);
+
+        // Saving again replaces the file; the open mapping keeps the old keys.
+        tree<int> u;
+        u.insert(7);
+        u.save(path);
+        CHECK(m.size() == 1000 && m[999] == 1998);
+        CHECK(mapped_tree<int>(path).size() == 1 && mapped_tree<int>(path).contains(7));
+
+        // Headers whose offsets wrap around when added to the key bytes are rejected.
+        t.save(path);
+        std::vector<char> file;
+        {
+            std::ifstream in(path, std::ios::binary);
+            file.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+        auto corrupt = [&](void (*edit)(mapped_tree_header&))
+        {
+            mapped_tree_header h;
+            std::memcpy(&h, file.data(), sizeof(h));
+            edit(h);
+            std::vector<char> bad(file);
+            std::memcpy(bad.data(), &h, sizeof(h));
+            std::ofstream(path, std::ios::binary | std::ios::trunc).write(bad.data(), static_cast<std::streamsize>(bad.size()));
+            return opens(path);
+        };
+        CHECK(corrupt([](mapped_tree_header&) { }));
+        CHECK(!corrupt([](mapped_tree_header& h) { h.sortedOffset = ~std::uint64_t(63); }));
+        CHECK(!corrupt([](mapped_tree_header& h) { h.eytzOffset = ~std::uint64_t(63); }));
+        CHECK(!corrupt([](mapped_tree_header& h) { h.count = ~std::uint64_t(0) / sizeof(int) + 2; }));
+        CHECK(!corrupt([](mapped_tree_header& h) { h.eytzOffset = h.sortedOffset; }));
+        std::remove(path.c_str());
+    }
+}
+
+int main()
+{
+    testInsertErase();
+    testSplitJoin();
+    testBatches();
+    testMergeExtract();
+    testEraseRanges();
+    testHintedInsert();
+    testSetOperations();
+    testAggregates();
+    testParallelBuild();
+    testParallelSetOperations();
+    testNodePoolClear();
+    testAvlAddOwnElement();
+    testAvlAssignSorted();
+    testAvlTraversals();
+    testMappedTree();
+    if (failures)
+        std::printf("%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}
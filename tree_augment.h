@@ -0,0 +1,59 @@
+// Augmentation policies for tree<T>.
+//
+// A policy attaches a monoid value to every node, kept equal to the combination
+// of its subtree in order, so tree::aggregate(lo, hi) answers in O(log n). A
+// policy provides
+//
+//   using value_type = ...;
+//   static value_type identity();
+//   static value_type lift(const T& t);                           // value of one element
+//   static value_type combine(const value_type& a, const value_type& b);
+//
+// combine must be associative with identity as its neutral element; it need not
+// be commutative, as a and b are always in element order.
+#pragma once
+#include <algorithm>  // min, max
+#include <limits>
+
+// The default: nodes carry nothing and aggregate() is unavailable.
+struct no_augment { };
+
+// Projection returning the element itself.
+struct identity_projection
+{
+    template <typename U>
+    const U& operator() (const U& u) const { return u; }
+};
+
+// Sum of Proj(element) as V.
+template <typename V, typename Proj = identity_projection>
+struct sum_augment
+{
+    using value_type = V;
+    static value_type identity() { return V(); }
+    template <typename T>
+    static value_type lift(const T& t) { return static_cast<V>(Proj()(t)); }
+    static value_type combine(const value_type& a, const value_type& b) { return a + b; }
+};
+
+// Least Proj(element); identity is the largest V.
+template <typename V, typename Proj = identity_projection>
+struct min_augment
+{
+    using value_type = V;
+    static value_type identity() { return std::numeric_limits<V>::max(); }
+    template <typename T>
+    static value_type lift(const T& t) { return static_cast<V>(Proj()(t)); }
+    static value_type combine(const value_type& a, const value_type& b) { return std::min(a, b); }
+};
+
+// Greatest Proj(element); identity is the lowest V.
+template <typename V, typename Proj = identity_projection>
+struct max_augment
+{
+    using value_type = V;
+    static value_type identity() { return std::numeric_limits<V>::lowest(); }
+    template <typename T>
+    static value_type lift(const T& t) { return static_cast<V>(Proj()(t)); }
+    static value_type combine(const value_type& a, const value_type& b) { return std::max(a, b); }
+};
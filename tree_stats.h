@@ -0,0 +1,79 @@
+// Operation counters and shape statistics for avl<T> and tree<T>.
+//
+// Define AVL_TREE_STATS before including the tree headers to count operations;
+// without it the counters are empty inline functions and cost nothing. The
+// shape part of a snapshot is computed on demand either way.
+#pragma once
+#include <cstddef>
+#include <vector>
+
+struct tree_stats
+{
+    // Operation counters, all zero unless AVL_TREE_STATS is defined. Batch
+    // inserts, merges and range erases count each element they add or remove.
+    std::size_t inserts = 0;
+    std::size_t erases = 0;
+    std::size_t finds = 0;
+    std::size_t findComparisons = 0;         // Comparisons made by lookups.
+    std::size_t insertRotations = 0;         // Single rotations done to rebalance inserts.
+    std::size_t eraseRotations = 0;
+    std::size_t insertRetraceSteps = 0;      // Levels climbed rebalancing after inserts.
+    std::size_t eraseRetraceSteps = 0;
+
+    // Shape at the time of the snapshot.
+    std::size_t size = 0;
+    std::size_t height = 0;
+    std::size_t bytes = 0;                   // Node storage, excluding allocator overhead.
+    std::vector<std::size_t> levels;         // Node count at each depth, root first.
+
+    double averageDepth() const
+    {
+        double sum = 0;
+        for (std::size_t d = 0; d < levels.size(); ++d)
+            sum += double(d + 1) * levels[d];
+        return size ? sum / size : 0;
+    }
+};
+
+class tree_counters
+{
+public:
+#ifdef AVL_TREE_STATS
+    void insert(std::size_t n = 1) noexcept { s.inserts += n; }
+    void erase(std::size_t n = 1) noexcept { s.erases += n; }
+    void find() noexcept { ++s.finds; }
+    void compare() noexcept { ++s.findComparisons; }
+    void rotate(bool erasing, std::size_t n = 1) noexcept { (erasing ? s.eraseRotations : s.insertRotations) += n; }
+    void retrace(bool erasing) noexcept { ++(erasing ? s.eraseRetraceSteps : s.insertRetraceSteps); }
+
+    void read(tree_stats& out) const noexcept
+    {
+        out.inserts = s.inserts;
+        out.erases = s.erases;
+        out.finds = s.finds;
+        out.findComparisons = s.findComparisons;
+        out.insertRotations = s.insertRotations;
+        out.eraseRotations = s.eraseRotations;
+        out.insertRetraceSteps = s.insertRetraceSteps;
+        out.eraseRetraceSteps = s.eraseRetraceSteps;
+    }
+    void reset() noexcept { s = counts(); }
+
+private:
+    struct counts
+    {
+        std::size_t inserts = 0, erases = 0, finds = 0, findComparisons = 0;
+        std::size_t insertRotations = 0, eraseRotations = 0;
+        std::size_t insertRetraceSteps = 0, eraseRetraceSteps = 0;
+    } s;
+#else
+    void insert(std::size_t = 1) noexcept { }
+    void erase(std::size_t = 1) noexcept { }
+    void find() noexcept { }
+    void compare() noexcept { }
+    void rotate(bool, std::size_t = 1) noexcept { }
+    void retrace(bool) noexcept { }
+    void read(tree_stats&) const noexcept { }
+    void reset() noexcept { }
+#endif
+};